@@ -0,0 +1,136 @@
+#include "file_input.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+constexpr std::size_t MAX_READERS = 8;
+
+static std::atomic<std::uint64_t> next_id(0);
+
+thread_local std::vector<std::pair<std::uint64_t, ChunkedFileInput::Reader>> ChunkedFileInput::readers;
+
+ChunkedFileInput::ChunkedFileInput(const char* path, std::size_t cache_size, std::size_t block_size): id(next_id++), fd(open(path, O_RDONLY)), size_(0), block_size(std::max<std::size_t>(block_size, 1)), max_blocks(std::max<std::size_t>(cache_size / this->block_size, 2)), read_ahead(std::max(cache_size / 4, this->block_size)) {
+	struct stat status;
+	if (fd >= 0 && fstat(fd, &status) < 0) {
+		close(fd);
+		fd = -1;
+	}
+	if (fd < 0) {
+		return;
+	}
+	size_ = status.st_size;
+#ifdef POSIX_FADV_RANDOM
+	// the kernel would read ahead on its own, the reads ahead are chosen here instead
+	posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+#endif
+}
+ChunkedFileInput::~ChunkedFileInput() {
+	if (fd >= 0) {
+		close(fd);
+	}
+}
+
+// the most recently used reader is moved to the front, the least recently used one is evicted
+ChunkedFileInput::Reader& ChunkedFileInput::get_reader() const {
+	auto iter = std::find_if(readers.begin(), readers.end(), [this](const std::pair<std::uint64_t, Reader>& reader) {
+		return reader.first == id;
+	});
+	if (iter == readers.end()) {
+		if (readers.size() >= MAX_READERS) {
+			readers.pop_back();
+		}
+		readers.emplace_back(id, Reader{nullptr, 0});
+		iter = readers.end() - 1;
+	}
+	std::rotate(readers.begin(), iter, iter + 1);
+	return readers.front().second;
+}
+
+std::shared_ptr<ChunkedFileInput::Block> ChunkedFileInput::load_block(std::size_t index) const {
+	std::shared_ptr<Block> block;
+	if (blocks.size() >= max_blocks) {
+		block = std::move(blocks.back());
+		blocks.pop_back();
+		block_index.erase(block->offset / block_size);
+#ifdef POSIX_FADV_DONTNEED
+		posix_fadvise(fd, block->offset, block->data.size(), POSIX_FADV_DONTNEED);
+#endif
+		// the block may still be used by a thread
+		if (block.use_count() > 1) {
+			block = nullptr;
+		}
+	}
+	if (block == nullptr) {
+		block = std::make_shared<Block>();
+	}
+	block->offset = index * block_size;
+	block->data.resize(std::min(block_size, size_ - block->offset));
+	std::size_t filled = 0;
+	while (filled < block->data.size()) {
+		const ssize_t n = pread(fd, block->data.data() + filled, block->data.size() - filled, block->offset + filled);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		filled += n;
+	}
+	// a file that has become shorter ends early
+	block->data.resize(filled);
+	return block;
+}
+void ChunkedFileInput::advise_read(std::size_t start, std::size_t end) const {
+	end = std::min(end, size_);
+#ifdef POSIX_FADV_WILLNEED
+	if (start < end) {
+		posix_fadvise(fd, start, end - start, POSIX_FADV_WILLNEED);
+	}
+#endif
+}
+Input::Chunk ChunkedFileInput::use_block(std::size_t index) const {
+	auto iter = block_index.find(index);
+	if (iter != block_index.end()) {
+		blocks.splice(blocks.begin(), blocks, iter->second);
+	}
+	else {
+		blocks.push_front(load_block(index));
+		block_index[index] = blocks.begin();
+	}
+	const std::shared_ptr<Block>& block = blocks.front();
+	get_reader().block = block;
+	return {block.get(), block->data.data(), block->data.size()};
+}
+
+std::pair<Input::Chunk, std::size_t> ChunkedFileInput::get_chunk(std::size_t pos) const {
+	if (pos >= size_) {
+		return {{nullptr, "", 0}, pos};
+	}
+	std::lock_guard<std::mutex> lock(mutex);
+	const std::size_t index = pos / block_size;
+	return {use_block(index), index * block_size};
+}
+Input::Chunk ChunkedFileInput::get_next_chunk(const void* chunk) const {
+	const Block* block = static_cast<const Block*>(chunk);
+	if (block == nullptr || block->data.size() < block_size || block->offset + block_size >= size_) {
+		return {nullptr, "", 0};
+	}
+	const std::size_t offset = block->offset + block_size;
+	std::lock_guard<std::mutex> lock(mutex);
+	// reading on sequentially, the next part of the file is requested before it is needed
+	std::size_t& read_ahead_end = get_reader().read_ahead_end;
+	if (offset + read_ahead / 2 >= read_ahead_end) {
+		advise_read(std::max(offset, read_ahead_end), offset + read_ahead);
+		read_ahead_end = offset + read_ahead;
+	}
+	return use_block(offset / block_size);
+}
+void ChunkedFileInput::prefetch(std::size_t start, std::size_t end) const {
+	std::lock_guard<std::mutex> lock(mutex);
+	end = std::min(end, start + read_ahead);
+	advise_read(start, end);
+	get_reader().read_ahead_end = end;
+}
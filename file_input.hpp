@@ -0,0 +1,56 @@
+#pragma once
+
+#include "prism.hpp"
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+
+// reads a file in blocks with pread and keeps at most cache_size bytes of them, the least recently used blocks are dropped
+// and so are their pages in the page cache, so files larger than memory can be highlighted in arbitrary windows
+// a chunk stays valid until the thread that got it asks for another one, or for chunks of several other inputs
+class ChunkedFileInput final: public Input {
+	struct Block {
+		std::size_t offset;
+		std::vector<char> data;
+	};
+	using BlockList = std::list<std::shared_ptr<Block>>;
+	// each thread reads its own part of the file
+	struct Reader {
+		// the last block the thread got, kept alive even if it has been dropped from the cache
+		std::shared_ptr<Block> block;
+		// the end of the part the kernel has been asked to read ahead, zero for a new reader
+		std::size_t read_ahead_end;
+	};
+	// the readers of the inputs a thread used most recently, they go away with the thread
+	static thread_local std::vector<std::pair<std::uint64_t, Reader>> readers;
+	// never reused, so readers of a destroyed input cannot be mistaken for readers of this one
+	std::uint64_t id;
+	int fd;
+	std::size_t size_;
+	std::size_t block_size;
+	std::size_t max_blocks;
+	std::size_t read_ahead;
+	mutable std::mutex mutex;
+	// the most recently used block first
+	mutable BlockList blocks;
+	mutable std::unordered_map<std::size_t, BlockList::iterator> block_index;
+	Reader& get_reader() const;
+	std::shared_ptr<Block> load_block(std::size_t index) const;
+	void advise_read(std::size_t start, std::size_t end) const;
+	Chunk use_block(std::size_t index) const;
+public:
+	ChunkedFileInput(const char* path, std::size_t cache_size = 16 << 20, std::size_t block_size = 1 << 16);
+	ChunkedFileInput(const ChunkedFileInput&) = delete;
+	ChunkedFileInput& operator =(const ChunkedFileInput&) = delete;
+	~ChunkedFileInput();
+	bool is_open() const {
+		return fd >= 0;
+	}
+	std::size_t size() const {
+		return size_;
+	}
+	std::pair<Chunk, std::size_t> get_chunk(std::size_t pos) const override;
+	Chunk get_next_chunk(const void* chunk) const override;
+	void prefetch(std::size_t start, std::size_t end) const override;
+};
@@ -0,0 +1,377 @@
+#include <prism.hpp>
+#include <vector>
+#include <string>
+#include <map>
+#include <cmath>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <filesystem>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+
+namespace fs = std::filesystem;
+
+class FileInput final: public Input {
+	std::string data_;
+public:
+	FileInput(std::string data): data_(std::move(data)) {}
+	const char* data() const {
+		return data_.data();
+	}
+	std::size_t size() const {
+		return data_.size();
+	}
+	std::pair<Chunk, std::size_t> get_chunk(std::size_t pos) const override {
+		return {{nullptr, data(), size()}, 0};
+	}
+	Chunk get_next_chunk(const void* chunk) const override {
+		return {nullptr, "", 0};
+	}
+};
+
+static bool read_file(const fs::path& path, std::string& data) {
+	std::ifstream file(path, std::ios::binary);
+	if (!file) {
+		return false;
+	}
+	std::ostringstream stream;
+	stream << file.rdbuf();
+	data = stream.str();
+	return true;
+}
+
+static std::uint64_t get_hash(const std::string& data) {
+	// FNV-1a
+	std::uint64_t hash = 0xcbf29ce484222325;
+	for (char c: data) {
+		hash = (hash ^ static_cast<unsigned char>(c)) * 0x100000001b3;
+	}
+	return hash;
+}
+
+static std::string get_css_color(const Color& color) {
+	std::ostringstream css;
+	css << "rgb(" << std::round(color.r * 255) << "," << std::round(color.g * 255) << "," << std::round(color.b * 255) << ")";
+	return css.str();
+}
+static void write_css(std::ostream& css, const Style& style) {
+	css << "color:" << get_css_color(style.color) << ";";
+	if (style.bold) {
+		css << "font-weight:bold;";
+	}
+	if (style.italic) {
+		css << "font-style:italic;";
+	}
+}
+// the class of a style is the name of its semantic token type
+static void write_stylesheet(std::ostream& css, const Theme& theme) {
+	css << ".prism{background:" << get_css_color(theme.background) << ";";
+	write_css(css, theme.styles[Style::DEFAULT]);
+	css << "}\n";
+	const std::vector<const char*> types = prism::get_semantic_token_types();
+	for (std::size_t i = 0; i < types.size(); ++i) {
+		css << ".prism ." << types[i] << "{";
+		write_css(css, theme.styles[Style::COMMENT + i]);
+		css << "}\n";
+	}
+}
+
+static void write_escaped(std::ostream& html, const char* data, std::size_t size) {
+	const char* last = data;
+	const char* end = data + size;
+	for (const char* i = data; i < end; ++i) {
+		const char* entity = *i == '<' ? "&lt;" : *i == '>' ? "&gt;" : *i == '&' ? "&amp;" : nullptr;
+		if (entity) {
+			html.write(last, i - last);
+			html << entity;
+			last = i + 1;
+		}
+	}
+	html.write(last, end - last);
+}
+
+static void write_html(std::ostream& html, const FileInput& input, const std::vector<Span>& spans, const std::string& title, const std::string& stylesheet) {
+	const std::vector<const char*> types = prism::get_semantic_token_types();
+	html << "<!DOCTYPE html>\n<html>\n<head>\n<meta charset=\"utf-8\">\n<title>";
+	write_escaped(html, title.data(), title.size());
+	html << "</title>\n<link rel=\"stylesheet\" href=\"" << stylesheet << "\">\n</head>\n<body>\n<pre class=\"prism\">";
+	std::size_t i = 0;
+	for (const Span& span: spans) {
+		write_escaped(html, input.data() + i, span.start - i);
+		if (span.style >= Style::COMMENT) {
+			html << "<span class=\"" << types[span.style - Style::COMMENT] << "\">";
+			write_escaped(html, input.data() + span.start, span.end - span.start);
+			html << "</span>";
+		}
+		else {
+			write_escaped(html, input.data() + span.start, span.end - span.start);
+		}
+		i = span.end;
+	}
+	write_escaped(html, input.data() + i, input.size() - i);
+	html << "</pre>\n</body>\n</html>\n";
+}
+
+// the manifest of the previous run, files whose size and modification time match are not read again
+// and files whose content hash matches are not highlighted again
+struct ManifestEntry {
+	std::uint64_t hash;
+	std::uintmax_t size;
+	std::int64_t time;
+};
+using Manifest = std::map<std::string, ManifestEntry>;
+static constexpr const char* MANIFEST_NAME = ".prism-manifest";
+
+static Manifest read_manifest(const fs::path& path, const std::string& theme) {
+	Manifest manifest;
+	std::ifstream file(path);
+	std::string line;
+	if (!std::getline(file, line) || line != std::string("prism-html 1 ") + theme) {
+		return manifest;
+	}
+	while (std::getline(file, line)) {
+		std::istringstream stream(line);
+		ManifestEntry entry;
+		std::string name;
+		stream >> std::hex >> entry.hash >> std::dec >> entry.size >> entry.time;
+		stream.get();
+		if (stream && std::getline(stream, name)) {
+			manifest[name] = entry;
+		}
+	}
+	return manifest;
+}
+// returns false if the manifest could not be written, the old one is kept then
+static bool write_manifest(const fs::path& path, const std::string& theme, const Manifest& manifest) {
+	const fs::path temporary = path.string() + ".tmp";
+	std::ofstream file(temporary);
+	file << "prism-html 1 " << theme << "\n";
+	for (const auto& entry: manifest) {
+		file << std::hex << entry.second.hash << std::dec << " " << entry.second.size << " " << entry.second.time << " " << entry.first << "\n";
+	}
+	file.close();
+	std::error_code error;
+	if (file) {
+		fs::rename(temporary, path, error);
+	}
+	if (!file || error) {
+		fs::remove(temporary, error);
+		return false;
+	}
+	return true;
+}
+
+struct Job {
+	fs::path source;
+	std::string name;
+	const Language* language;
+	std::uintmax_t size;
+	std::int64_t time;
+};
+
+class Exporter {
+	const fs::path& output;
+	const Manifest& old_manifest;
+	std::vector<Job> jobs;
+	std::atomic<std::size_t> next_job;
+	std::mutex mutex;
+	Manifest manifest;
+	std::size_t exported;
+	std::size_t unchanged;
+	std::size_t failed;
+	static fs::path get_output_path(const fs::path& output, const std::string& name) {
+		return output / (name + ".html");
+	}
+	// returns false if the file could not be exported, updates entry otherwise
+	bool export_file(const Job& job, ManifestEntry& entry, bool& changed) {
+		const fs::path path = get_output_path(output, job.name);
+		auto old_entry = old_manifest.find(job.name);
+		const bool has_output = old_entry != old_manifest.end() && fs::exists(path);
+		if (has_output && old_entry->second.size == job.size && old_entry->second.time == job.time) {
+			entry = old_entry->second;
+			changed = false;
+			return true;
+		}
+		std::string data;
+		if (!read_file(job.source, data)) {
+			return false;
+		}
+		entry = ManifestEntry{get_hash(data), job.size, job.time};
+		if (has_output && old_entry->second.hash == entry.hash) {
+			changed = false;
+			return true;
+		}
+		changed = true;
+		FileInput input(std::move(data));
+		Cache cache;
+		const std::vector<Span> spans = prism::highlight(job.language, &input, cache, 0, input.size());
+		std::string stylesheet;
+		const fs::path name = job.name;
+		for (auto i = name.begin(); std::next(i) != name.end(); ++i) {
+			stylesheet += "../";
+		}
+		stylesheet += "prism.css";
+		std::error_code error;
+		fs::create_directories(path.parent_path(), error);
+		// the old output stays in place until the new one is complete
+		const fs::path temporary = path.string() + ".tmp";
+		std::ofstream html(temporary, std::ios::binary);
+		write_html(html, input, spans, job.name, stylesheet);
+		html.close();
+		if (html) {
+			fs::rename(temporary, path, error);
+		}
+		if (!html || error) {
+			fs::remove(temporary, error);
+			return false;
+		}
+		return true;
+	}
+	void run_worker() {
+		for (std::size_t i = next_job++; i < jobs.size(); i = next_job++) {
+			ManifestEntry entry;
+			bool changed;
+			const bool success = export_file(jobs[i], entry, changed);
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!success) {
+				std::cerr << "cannot export " << jobs[i].source.string() << "\n";
+				++failed;
+				// the old output is kept, its entry keeps it from being removed and has it exported again next time
+				auto old_entry = old_manifest.find(jobs[i].name);
+				if (old_entry != old_manifest.end()) {
+					manifest[jobs[i].name] = old_entry->second;
+				}
+				continue;
+			}
+			manifest[jobs[i].name] = entry;
+			++(changed ? exported : unchanged);
+		}
+	}
+public:
+	Exporter(const fs::path& output, const Manifest& old_manifest, std::vector<Job> jobs): output(output), old_manifest(old_manifest), jobs(std::move(jobs)), next_job(0), exported(0), unchanged(0), failed(0) {
+		// the largest files first so that no thread is left with a large file at the end
+		std::sort(this->jobs.begin(), this->jobs.end(), [](const Job& a, const Job& b) {
+			return a.size > b.size;
+		});
+	}
+	void run(std::size_t threads) {
+		std::vector<std::thread> workers;
+		for (std::size_t i = 1; i < threads; ++i) {
+			workers.emplace_back(&Exporter::run_worker, this);
+		}
+		run_worker();
+		for (std::thread& worker: workers) {
+			worker.join();
+		}
+		// remove the output of files that no longer exist
+		for (const auto& entry: old_manifest) {
+			if (manifest.find(entry.first) == manifest.end()) {
+				std::error_code error;
+				fs::remove(get_output_path(output, entry.first), error);
+			}
+		}
+	}
+	const Manifest& get_manifest() const {
+		return manifest;
+	}
+	void print_summary() const {
+		std::cerr << exported << " exported, " << unchanged << " unchanged";
+		if (failed > 0) {
+			std::cerr << ", " << failed << " failed";
+		}
+		std::cerr << "\n";
+	}
+	bool has_failed() const {
+		return failed > 0;
+	}
+};
+
+static std::vector<Job> find_jobs(const fs::path& source, const fs::path& output) {
+	std::vector<Job> jobs;
+	std::error_code error;
+	const fs::path absolute_output = fs::weakly_canonical(output, error);
+	for (auto i = fs::recursive_directory_iterator(source, fs::directory_options::skip_permission_denied, error); i != fs::recursive_directory_iterator(); i.increment(error)) {
+		if (error) {
+			break;
+		}
+		const fs::path& path = i->path();
+		// skip hidden files and directories such as .git and the output directory itself
+		if (path.filename().string()[0] == '.' || (i->is_directory(error) && fs::weakly_canonical(path, error) == absolute_output)) {
+			if (i->is_directory(error)) {
+				i.disable_recursion_pending();
+			}
+			continue;
+		}
+		if (!i->is_regular_file(error)) {
+			continue;
+		}
+		const std::string file_name = path.filename().string();
+		const Language* language = prism::get_language(file_name.c_str());
+		if (language == nullptr) {
+			continue;
+		}
+		const std::uintmax_t size = i->file_size(error);
+		const std::int64_t time = i->last_write_time(error).time_since_epoch().count();
+		jobs.push_back({path, path.lexically_relative(source).generic_string(), language, size, time});
+	}
+	return jobs;
+}
+
+static bool parse_size(const char* string, std::size_t& value) {
+	char* end;
+	errno = 0;
+	const unsigned long long result = std::strtoull(string, &end, 10);
+	if (end == string || *end != '\0' || errno == ERANGE || *string == '-') {
+		return false;
+	}
+	value = result;
+	return true;
+}
+
+int main(int argc, const char** argv) {
+	const char* theme_name = "one-dark";
+	std::size_t threads = std::max(std::thread::hardware_concurrency(), 1u);
+	std::vector<const char*> paths;
+	for (int i = 1; i < argc; ++i) {
+		const std::string argument = argv[i];
+		if (argument == "--theme" && i + 1 < argc) {
+			theme_name = argv[++i];
+		}
+		else if (argument == "--threads" && i + 1 < argc && parse_size(argv[i + 1], threads)) {
+			threads = std::max(threads, std::size_t(1));
+			++i;
+		}
+		else {
+			paths.push_back(argv[i]);
+		}
+	}
+	if (paths.size() != 2) {
+		std::cerr << "Usage: " << argv[0] << " SOURCE_DIRECTORY OUTPUT_DIRECTORY [--theme THEME] [--threads N]\n";
+		return 1;
+	}
+	const fs::path source = paths[0];
+	const fs::path output = paths[1];
+	const Theme& theme = prism::get_theme(theme_name);
+	std::error_code error;
+	fs::create_directories(output, error);
+	std::ofstream css(output / "prism.css");
+	write_stylesheet(css, theme);
+	if (!css) {
+		std::cerr << "cannot write to " << output.string() << "\n";
+		return 1;
+	}
+	const Manifest old_manifest = read_manifest(output / MANIFEST_NAME, theme.name);
+	Exporter exporter(output, old_manifest, find_jobs(source, output));
+	exporter.run(threads);
+	exporter.print_summary();
+	if (!write_manifest(output / MANIFEST_NAME, theme.name, exporter.get_manifest())) {
+		std::cerr << "cannot write " << (output / MANIFEST_NAME).string() << "\n";
+		return 1;
+	}
+	return exporter.has_failed() ? 1 : 0;
+}
@@ -73,15 +73,15 @@ struct html_language {
 		)),
 		// CSS
 		sequence(
-			highlight<Style::KEYWORD>(html_start_tag("style")),
-			repetition(sequence(not_(html_end_tag("style")), choice(reference<css_language>(), any_char()))),
-			highlight<Style::KEYWORD>(optional(html_end_tag("style")))
+			highlight<Style::KEYWORD>(opening_delimiter<'<'>(html_start_tag("style"))),
+			repetition(sequence(not_(html_end_tag("style")), choice(reference<css_language>(), brackets(), any_char()))),
+			highlight<Style::KEYWORD>(optional(closing_delimiter<'<'>(html_end_tag("style"))))
 		),
 		// JavaScript
 		sequence(
-			highlight<Style::KEYWORD>(html_start_tag("script")),
-			repetition(sequence(not_(html_end_tag("script")), choice(reference<javascript_language>(), any_char()))),
-			highlight<Style::KEYWORD>(optional(html_end_tag("script")))
+			highlight<Style::KEYWORD>(opening_delimiter<'<'>(html_start_tag("script"))),
+			repetition(sequence(not_(html_end_tag("script")), choice(reference<javascript_language>(), brackets(), any_char()))),
+			highlight<Style::KEYWORD>(optional(closing_delimiter<'<'>(html_end_tag("script"))))
 		),
 		// start tags
 		highlight<Style::KEYWORD>(sequence(
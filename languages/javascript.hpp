@@ -16,9 +16,9 @@ constexpr auto javascript_template_string = sequence(
 	repetition(choice(
 		highlight<Style::ESCAPE>(javascript_escape),
 		highlight<Style::DEFAULT>(sequence(
-			"${",
+			opening_delimiter<'{'>("${"),
 			repetition(sequence(not_('}'), choice(reference<javascript_language>(), any_char()))),
-			optional('}')
+			optional(closing_delimiter<'{'>('}'))
 		)),
 		any_char_but('`')
 	)),
@@ -136,10 +136,11 @@ struct javascript_language {
 			"export"
 		)),
 		sequence(
-			'{',
+			opening_delimiter<'{'>('{'),
 			repetition(sequence(not_('}'), choice(reference<javascript_language>(), any_char()))),
-			optional('}')
+			optional(closing_delimiter<'{'>('}'))
 		),
+		brackets(),
 		// identifiers
 		java_identifier
 	);
@@ -1,5 +1,7 @@
 #include "prism.hpp"
 #include <cstring>
+#include <cstdint>
+#include <type_traits>
 
 #include "themes/one_dark.hpp"
 #include "themes/monokai.hpp"
@@ -18,125 +20,610 @@ const Theme& prism::get_theme(const char* name) {
 	return one_dark_theme;
 }
 
+class CharSet {
+	std::uint64_t bits[4];
+public:
+	constexpr CharSet(): bits{0, 0, 0, 0} {}
+	template <class F> static constexpr CharSet from_function(F f) {
+		CharSet set;
+		for (int c = 0; c < 256; ++c) {
+			if (f(static_cast<char>(c))) {
+				set.insert(static_cast<char>(c));
+			}
+		}
+		return set;
+	}
+	static constexpr CharSet all() {
+		return ~CharSet();
+	}
+	constexpr void insert(char c) {
+		const unsigned char i = c;
+		bits[i >> 6] |= std::uint64_t(1) << (i & 63);
+	}
+	constexpr bool contains(char c) const {
+		const unsigned char i = c;
+		return bits[i >> 6] >> (i & 63) & 1;
+	}
+	constexpr bool operator ()(char c) const {
+		return contains(c);
+	}
+	constexpr std::size_t size() const {
+		std::size_t size = 0;
+		for (int c = 0; c < 256; ++c) {
+			size += contains(static_cast<char>(c));
+		}
+		return size;
+	}
+	constexpr CharSet operator ~() const {
+		CharSet set;
+		for (int i = 0; i < 4; ++i) {
+			set.bits[i] = ~bits[i];
+		}
+		return set;
+	}
+	constexpr CharSet operator |(const CharSet& set) const {
+		CharSet result;
+		for (int i = 0; i < 4; ++i) {
+			result.bits[i] = bits[i] | set.bits[i];
+		}
+		return result;
+	}
+	constexpr CharSet operator &(const CharSet& set) const {
+		CharSet result;
+		for (int i = 0; i < 4; ++i) {
+			result.bits[i] = bits[i] & set.bits[i];
+		}
+		return result;
+	}
+	constexpr CharSet operator -(const CharSet& set) const {
+		return *this & ~set;
+	}
+	explicit constexpr operator bool() const {
+		return bits[0] || bits[1] || bits[2] || bits[3];
+	}
+};
+
+class CharScanner {
+	CharSet chars;
+	int delimiter;
+	bool stop_at_nul;
+	static constexpr int get_delimiter(const CharSet& chars) {
+		const CharSet stop_chars = ~chars;
+		for (int c = 1; c < 256; ++c) {
+			if (stop_chars.contains(static_cast<char>(c))) {
+				return stop_chars.size() - stop_chars.contains('\0') == 1 ? c : -1;
+			}
+		}
+		return -1;
+	}
+public:
+	constexpr CharScanner(const CharSet& chars): chars(chars), delimiter(get_delimiter(chars)), stop_at_nul(!chars.contains('\0')) {}
+	explicit constexpr operator bool() const {
+		return static_cast<bool>(chars);
+	}
+	const char* skip(const char* first, const char* last) const {
+		if (delimiter >= 0) {
+			if (const void* found = std::memchr(first, delimiter, last - first)) {
+				last = static_cast<const char*>(found);
+			}
+			if (stop_at_nul) {
+				if (const void* found = std::memchr(first, '\0', last - first)) {
+					last = static_cast<const char*>(found);
+				}
+			}
+			return last;
+		}
+		while (first != last && chars.contains(*first)) {
+			++first;
+		}
+		return first;
+	}
+};
+
+// the input appears to end at end, and cut_off records whether the parse ran into it
+// examined records whether the byte at the current position has been looked at
 class InputAdapter {
 	const Input* input;
-	Input::Chunk chunk;
+	const void* chunk;
+	const char* chunk_begin;
+	const char* chunk_end;
+	const char* current;
 	std::size_t offset;
-	std::size_t i;
-public:
-	InputAdapter(const Input* input): input(input), chunk({nullptr, nullptr, 0}), offset(0), i(0) {
-		set_position(0);
+	std::size_t end;
+	bool truncated;
+	bool cut_off;
+	bool examined;
+	void set_chunk(const Input::Chunk& new_chunk, std::size_t new_offset) {
+		chunk = new_chunk.chunk;
+		offset = new_offset;
+		const std::size_t max_size = end - std::min(end, offset);
+		truncated = new_chunk.size > max_size;
+		chunk_begin = new_chunk.data;
+		chunk_end = chunk_begin + (truncated ? max_size : new_chunk.size);
+		current = chunk_begin;
+	}
+	void next_chunk() {
+		if (truncated) {
+			offset += chunk_end - chunk_begin;
+			chunk_begin = chunk_end;
+			truncated = false;
+			cut_off = true;
+		}
+		else {
+			set_chunk(input->get_next_chunk(chunk), offset + (chunk_end - chunk_begin));
+		}
 	}
-	char get() const {
-		return i < chunk.size ? chunk.data[i] : '\0';
+public:
+	// no chunk is requested until set_position, which has to be called before the input is read
+	// the parse calls it when it moves to the first checkpoint, so only the chunk there is read
+	InputAdapter(const Input* input, std::size_t end = SIZE_MAX): input(input), chunk(nullptr), chunk_begin(nullptr), chunk_end(nullptr), current(nullptr), offset(0), end(end), truncated(false), cut_off(false), examined(false) {}
+	char get() {
+		examined = true;
+		if (current < chunk_end) {
+			return *current;
+		}
+		// the end of a truncated chunk can also be reached at a chunk boundary or through set_position
+		cut_off = cut_off || truncated;
+		return '\0';
 	}
 	void advance() {
-		++i;
-		if (i == chunk.size) {
-			offset += chunk.size;
-			chunk = input->get_next_chunk(chunk.chunk);
-			i = 0;
+		++current;
+		examined = false;
+		if (current == chunk_end) {
+			next_chunk();
+		}
+	}
+	// f is called with the position and the chars of each skipped run
+	template <class F> void skip(const CharScanner& scanner, std::size_t limit, F f) {
+		while (current < chunk_end && get_position() < limit) {
+			const char* last = chunk_begin + std::min<std::size_t>(chunk_end - chunk_begin, limit - offset);
+			const char* next = scanner.skip(current, last);
+			f(get_position(), current, next);
+			examined = examined && next == current;
+			current = next;
+			if (current == chunk_end) {
+				next_chunk();
+			}
+			else if (current != last) {
+				examined = true;
+				return;
+			}
 		}
 	}
 	std::size_t get_position() const {
-		return offset + i;
+		return offset + (current - chunk_begin);
+	}
+	// one past the furthest byte the parse has looked at from the current position
+	std::size_t get_examined_end() const {
+		return get_position() + examined;
 	}
 	void set_position(std::size_t pos) {
-		if (pos >= offset && pos - offset < chunk.size) {
-			i = pos - offset;
+		examined = false;
+		if (pos >= offset && pos - offset < static_cast<std::size_t>(chunk_end - chunk_begin)) {
+			current = chunk_begin + (pos - offset);
 		}
 		else {
 			auto chunk_pair = input->get_chunk(pos);
-			chunk = chunk_pair.first;
-			offset = chunk_pair.second;
-			i = pos - offset;
+			set_chunk(chunk_pair.first, chunk_pair.second);
+			current = chunk_begin + (pos - offset);
 		}
 	}
+	bool is_cut_off() const {
+		return cut_off;
+	}
+	void prefetch(std::size_t start, std::size_t end) const {
+		input->prefetch(start, std::min(end, this->end));
+	}
 };
 
-Cache::Node::Node(const void* expression, std::size_t start_pos, std::size_t start_max_pos): expression(expression), start_pos(start_pos), start_max_pos(start_max_pos) {}
+Cache::Node::Node(const void* expression, std::size_t start_pos, std::size_t start_max_pos): expression(expression), start(start_pos, start_max_pos) {}
 std::size_t Cache::Node::get_last_checkpoint() const {
 	if (checkpoints.empty()) {
-		return start_pos;
+		return start.get_pos();
 	}
-	return checkpoints.back().pos;
+	return checkpoints.back().get_pos();
 }
 void Cache::Node::add_checkpoint(std::size_t pos, std::size_t max_pos) {
-	checkpoints.push_back({pos, max_pos});
+	checkpoints.emplace_back(pos, max_pos);
 }
 const Cache::Checkpoint* Cache::Node::find_checkpoint(std::size_t pos) const {
-	auto iter = std::lower_bound(checkpoints.rbegin(), checkpoints.rend(), pos, [](const Checkpoint& checkpoint, std::size_t pos) {
-		return checkpoint.pos > pos;
+	const std::size_t i = checkpoints.partition_point([pos](const Checkpoint& checkpoint) {
+		return checkpoint.get_pos() <= pos;
 	});
-	if (iter != checkpoints.rend()) {
-		return &*iter;
+	if (i > 0) {
+		return &checkpoints[i - 1];
 	}
 	return nullptr;
 }
-Cache::Node* Cache::Node::find_child(const void* expression, std::size_t pos) {
-	auto iter = std::lower_bound(children.begin(), children.end(), pos, [](const Node& child, std::size_t pos) {
-		return child.start_pos < pos;
+std::size_t Cache::Node::find_child_index(const void* expression, std::size_t pos) const {
+	if (children.empty() || children.back().start.get_pos() < pos) {
+		return SIZE_MAX;
+	}
+	std::size_t i = children.partition_point([pos](const Node& child) {
+		return child.start.get_pos() < pos;
 	});
-	while (iter != children.end() && iter->start_pos == pos) {
-		if (iter->expression == expression) {
-			return &*iter;
+	while (i < children.size() && children[i].start.get_pos() == pos) {
+		if (children[i].expression == expression) {
+			return i;
 		}
-		++iter;
+		++i;
 	}
-	return nullptr;
+	return SIZE_MAX;
+}
+const Cache::Node* Cache::Node::find_child(const void* expression, std::size_t pos) const {
+	const std::size_t i = find_child_index(expression, pos);
+	return i != SIZE_MAX ? &children[i] : nullptr;
+}
+Cache::Node* Cache::Node::find_mutable_child(const void* expression, std::size_t pos) {
+	const std::size_t i = find_child_index(expression, pos);
+	return i != SIZE_MAX ? &children.get_mutable(i) : nullptr;
 }
 Cache::Node* Cache::Node::add_child(const void* expression, std::size_t pos, std::size_t max_pos) {
-	children.emplace_back(expression, pos, max_pos);
-	return &children.back();
+	return &children.emplace_back(expression, pos, max_pos);
 }
-void Cache::Node::invalidate(std::size_t pos) {
-	{
-		auto iter = std::lower_bound(checkpoints.begin(), checkpoints.end(), pos, [](const Checkpoint& checkpoint, std::size_t pos) {
-			return checkpoint.max_pos < pos;
-		});
-		checkpoints.erase(iter, checkpoints.end());
+Cache::Node Cache::Node::moved(std::size_t old_pos, std::size_t pos, std::size_t min_max_pos) const {
+	// the checkpoints inside a node have a max_pos of at least that of its start
+	if (pos == old_pos && start.get_max_pos() >= min_max_pos) {
+		return *this;
 	}
-	{
-		auto iter = std::lower_bound(children.begin(), children.end(), pos, [](const Node& child, std::size_t pos) {
-			return child.start_max_pos < pos;
-		});
-		children.erase(iter, children.end());
+	Node node(expression, 0, 0);
+	node.start = start.moved(old_pos, pos, min_max_pos);
+	// what would be moved past MAX_POS is dropped
+	for (std::size_t i = 0; i < checkpoints.size() && checkpoints[i].can_move(old_pos, pos); ++i) {
+		node.checkpoints.emplace_back(checkpoints[i].moved(old_pos, pos, min_max_pos));
+	}
+	for (std::size_t i = 0; i < children.size() && children[i].start.can_move(old_pos, pos); ++i) {
+		node.children.emplace_back(children[i].moved(old_pos, pos, min_max_pos));
 	}
+	return node;
+}
+void Cache::Node::graft(const Node& old_node, std::size_t old_pos, std::size_t pos, std::size_t min_max_pos) {
+	std::size_t i = old_node.checkpoints.partition_point([old_pos](const Checkpoint& checkpoint) {
+		return checkpoint.get_pos() <= old_pos;
+	});
+	for (; i < old_node.checkpoints.size() && old_node.checkpoints[i].can_move(old_pos, pos); ++i) {
+		checkpoints.emplace_back(old_node.checkpoints[i].moved(old_pos, pos, min_max_pos));
+	}
+	i = old_node.children.partition_point([old_pos](const Node& child) {
+		return child.start.get_pos() <= old_pos;
+	});
+	for (; i < old_node.children.size() && old_node.children[i].start.can_move(old_pos, pos); ++i) {
+		children.emplace_back(old_node.children[i].moved(old_pos, pos, min_max_pos));
+	}
+}
+void Cache::Node::invalidate(std::size_t pos) {
+	checkpoints.truncate(checkpoints.partition_point([pos](const Checkpoint& checkpoint) {
+		return checkpoint.get_max_pos() <= pos;
+	}));
+	children.truncate(children.partition_point([pos](const Node& child) {
+		return child.start.get_max_pos() <= pos;
+	}));
 	if (children.size() > 0) {
-		Cache::Node& last_child = children.back();
-		if (last_child.start_pos >= get_last_checkpoint()) {
-			last_child.invalidate(pos);
+		if (children.back().start.get_pos() >= get_last_checkpoint()) {
+			children.get_mutable(children.size() - 1).invalidate(pos);
+		}
+	}
+}
+std::size_t Cache::Node::get_memory_usage() const {
+	std::size_t memory_usage = checkpoints.get_memory_usage() + children.get_memory_usage();
+	for (std::size_t i = 0; i < children.size(); ++i) {
+		memory_usage += children[i].get_memory_usage();
+	}
+	return memory_usage;
+}
+void Cache::Node::collect_statistics(Statistics& statistics, std::size_t depth) const {
+	statistics.nodes += 1;
+	statistics.checkpoints += checkpoints.size();
+	statistics.depth = std::max(statistics.depth, depth);
+	statistics.frontier = std::max(statistics.frontier, get_last_checkpoint());
+	for (std::size_t i = 0; i < children.size(); ++i) {
+		children[i].collect_statistics(statistics, depth + 1);
+	}
+}
+Structure::Structure(bool enabled): frontier(0), enabled(enabled) {}
+std::uint32_t Structure::get_innermost_open(std::size_t size) const {
+	if (size == 0) {
+		return NONE;
+	}
+	const Delimiter& last = delimiters[size - 1];
+	if (last.open) {
+		return size - 1;
+	}
+	if (last.partner != NONE) {
+		return delimiters[last.partner].parent;
+	}
+	return last.parent;
+}
+bool Structure::is_enabled() const {
+	return enabled;
+}
+std::size_t Structure::get_frontier() const {
+	return frontier;
+}
+std::size_t Structure::size() const {
+	return delimiters.size();
+}
+const Structure::Delimiter& Structure::operator [](std::size_t i) const {
+	return delimiters[i];
+}
+std::uint32_t Structure::find(std::size_t pos) const {
+	const std::size_t i = delimiters.partition_point([pos](const Delimiter& delimiter) {
+		return delimiter.start <= pos;
+	});
+	if (i > 0 && pos < delimiters[i - 1].get_end()) {
+		return i - 1;
+	}
+	return NONE;
+}
+std::uint32_t Structure::find_enclosing(std::size_t pos) const {
+	const std::size_t i = delimiters.partition_point([pos](const Delimiter& delimiter) {
+		return delimiter.start <= pos;
+	});
+	if (i > 0 && !delimiters[i - 1].open && delimiters[i - 1].partner != NONE && pos < delimiters[i - 1].get_end()) {
+		return delimiters[i - 1].partner;
+	}
+	return get_innermost_open(i);
+}
+std::vector<Range> Structure::get_regions(std::size_t start, std::size_t end) const {
+	std::vector<Range> regions;
+	for (std::uint32_t i = find_enclosing(start); i != NONE; i = delimiters[i].parent) {
+		if (delimiters[i].start < start && delimiters[i].partner != NONE) {
+			regions.emplace_back(delimiters[i].start, delimiters[delimiters[i].partner].get_end());
+		}
+	}
+	std::reverse(regions.begin(), regions.end());
+	std::size_t i = delimiters.partition_point([start](const Delimiter& delimiter) {
+		return delimiter.start < start;
+	});
+	for (; i < delimiters.size() && delimiters[i].start < end; ++i) {
+		if (delimiters[i].open && delimiters[i].partner != NONE) {
+			regions.emplace_back(delimiters[i].start, delimiters[delimiters[i].partner].get_end());
+		}
+	}
+	return regions;
+}
+void Structure::add(Delimiter delimiter) {
+	delimiter.partner = NONE;
+	delimiter.parent = get_innermost_open(delimiters.size());
+	if (!delimiter.open && delimiter.parent != NONE && delimiters[delimiter.parent].kind == delimiter.kind) {
+		delimiter.partner = delimiter.parent;
+		delimiters.get_mutable(delimiter.parent).partner = delimiters.size();
+	}
+	delimiters.emplace_back(delimiter);
+}
+void Structure::append(const std::vector<Delimiter>& new_delimiters, std::size_t pos) {
+	for (const Delimiter& delimiter: new_delimiters) {
+		// the parse may have resumed before the frontier
+		if (delimiter.start >= frontier) {
+			add(delimiter);
 		}
 	}
+	frontier = std::max(frontier, pos);
 }
-Cache::Cache(): root_node(nullptr, 0, 0) {}
+void Structure::graft(const Structure& old_structure, std::size_t old_pos, std::size_t pos) {
+	if (old_structure.frontier <= old_pos) {
+		return;
+	}
+	std::size_t i = old_structure.delimiters.partition_point([old_pos](const Delimiter& delimiter) {
+		return delimiter.start < old_pos;
+	});
+	for (; i < old_structure.delimiters.size(); ++i) {
+		Delimiter delimiter = old_structure.delimiters[i];
+		delimiter.start = delimiter.start - old_pos + pos;
+		if (delimiter.start >= frontier) {
+			add(delimiter);
+		}
+	}
+	frontier = std::max(frontier, old_structure.frontier - old_pos + pos);
+}
+void Structure::invalidate(std::size_t pos) {
+	delimiters.truncate(delimiters.partition_point([pos](const Delimiter& delimiter) {
+		return delimiter.start < pos;
+	}));
+	// the delimiters that are still open lose their partners
+	for (std::uint32_t i = get_innermost_open(delimiters.size()); i != NONE; i = delimiters[i].parent) {
+		if (delimiters[i].partner != NONE) {
+			delimiters.get_mutable(i).partner = NONE;
+		}
+	}
+	frontier = std::min(frontier, pos);
+}
+std::size_t Structure::get_memory_usage() const {
+	return delimiters.get_memory_usage();
+}
+
+// appends the parts of the spans that are inside the range, joining adjacent spans of the same style
+static void append_spans(std::vector<Span>& spans, const std::vector<Span>& new_spans, const Range& range) {
+	auto iter = std::partition_point(new_spans.begin(), new_spans.end(), [&](const Span& span) {
+		return span.end <= range.start;
+	});
+	for (; iter != new_spans.end() && iter->start < range.end; ++iter) {
+		const Range clipped = *iter & range;
+		if (!clipped) {
+			continue;
+		}
+		if (!spans.empty() && spans.back().end == clipped.start && spans.back().style == iter->style) {
+			spans.back().end = clipped.end;
+		}
+		else {
+			spans.emplace_back(clipped.start, clipped.end, iter->style);
+		}
+	}
+}
+
+Cache::Cache(std::size_t max_depth, bool record_structure, std::size_t span_cache_size): root_node(std::make_shared<Node>(nullptr, 0, 0)), structure(record_structure), span_cache_size(span_cache_size), max_depth(max_depth), highlight_calls(0), last_rescan_distance(0), rescan_distances() {}
+Cache::Cache(const Cache&) = default;
+Cache::Cache(Cache&&) = default;
+Cache& Cache::operator =(const Cache&) = default;
+Cache& Cache::operator =(Cache&&) = default;
 Cache::~Cache() = default;
-Cache::Node* Cache::get_root_node() {
-	return &root_node;
+const Cache::Node* Cache::get_root_node() const {
+	return root_node.get();
+}
+Cache::Node* Cache::get_mutable_root_node() {
+	if (root_node.use_count() != 1) {
+		root_node = std::make_shared<Node>(*root_node);
+	}
+	return root_node.get();
+}
+std::size_t Cache::get_max_depth() const {
+	return max_depth;
+}
+const Structure& Cache::get_structure() const {
+	return structure;
+}
+Structure& Cache::get_structure() {
+	return structure;
+}
+std::size_t Cache::get_valid_end() const {
+	const Node* node = root_node.get();
+	std::size_t valid_end = node->get_last_checkpoint();
+	while (!node->children.empty() && node->children.back().start.get_pos() >= node->get_last_checkpoint()) {
+		node = &node->children.back();
+		valid_end = std::max(valid_end, node->get_last_checkpoint());
+	}
+	return valid_end;
+}
+void Cache::clip_span_runs(const Range& range) {
+	std::vector<SpanRun> new_span_runs;
+	for (SpanRun& run: span_runs) {
+		const Range clipped = run.range & range;
+		if (!clipped) {
+			continue;
+		}
+		if (clipped.start != run.range.start || clipped.end != run.range.end) {
+			std::vector<Span> spans;
+			append_spans(spans, run.spans, clipped);
+			run = SpanRun{clipped, std::move(spans)};
+		}
+		new_span_runs.push_back(std::move(run));
+	}
+	span_runs = std::move(new_span_runs);
+}
+std::size_t Cache::get_span_cache_size() const {
+	return span_cache_size;
+}
+const Cache::SpanRun* Cache::find_span_run(std::size_t pos) const {
+	auto run = std::partition_point(span_runs.begin(), span_runs.end(), [pos](const SpanRun& run) {
+		return run.range.end <= pos;
+	});
+	return run != span_runs.end() ? &*run : nullptr;
+}
+void Cache::add_span_run(const Range& range, const std::vector<Span>& spans) {
+	auto run = std::partition_point(span_runs.begin(), span_runs.end(), [&](const SpanRun& run) {
+		return run.range.end < range.start;
+	});
+	// join with the runs that touch the range
+	if (run != span_runs.end() && run->range.end == range.start) {
+		append_spans(run->spans, spans, range);
+		run->range.end = range.end;
+	}
+	else {
+		run = span_runs.insert(run, SpanRun{range, {}});
+		append_spans(run->spans, spans, range);
+	}
+	auto next = run + 1;
+	if (next != span_runs.end() && next->range.start == run->range.end) {
+		append_spans(run->spans, next->spans, next->range);
+		run->range.end = next->range.end;
+		span_runs.erase(next);
+	}
+}
+void Cache::trim_span_runs(const Range& window) {
+	std::size_t size = 0;
+	for (const SpanRun& run: span_runs) {
+		size += run.range.end - run.range.start;
+	}
+	if (size <= span_cache_size) {
+		return;
+	}
+	// trim to three quarters so that scrolling does not trim on every call
+	std::size_t excess = size - span_cache_size / 4 * 3;
+	const Range runs(span_runs.front().range.start, span_runs.back().range.end);
+	std::size_t before = window.start - std::min(window.start, runs.start);
+	std::size_t after = runs.end - std::min(runs.end, window.end);
+	// the side that is further from the window first, then both evenly
+	const std::size_t uneven = std::min(excess, std::max(before, after) - std::min(before, after));
+	(before > after ? before : after) -= uneven;
+	excess -= uneven;
+	const std::size_t even = std::min((excess + 1) / 2, std::min(before, after));
+	before -= even;
+	after -= even;
+	const Range keep(std::max(runs.start, window.start - before), std::min(runs.end, window.end + after));
+	clip_span_runs(keep);
 }
 void Cache::invalidate(std::size_t pos) {
-	root_node.invalidate(pos);
+	get_mutable_root_node()->invalidate(pos);
+	if (structure.is_enabled() || !span_runs.empty()) {
+		const std::size_t valid_end = get_valid_end();
+		if (structure.is_enabled()) {
+			structure.invalidate(valid_end);
+		}
+		clip_span_runs(Range(0, valid_end));
+	}
+}
+std::size_t Cache::get_memory_usage() const {
+	std::size_t memory_usage = sizeof(Cache) + sizeof(Node) + root_node->get_memory_usage() + structure.get_memory_usage();
+	for (const SpanRun& run: span_runs) {
+		memory_usage += sizeof(SpanRun) + run.spans.capacity() * sizeof(Span);
+	}
+	return memory_usage;
+}
+void Cache::add_rescan_distance(std::size_t distance) {
+	std::size_t bits = 0;
+	while (distance >> bits) {
+		++bits;
+	}
+	highlight_calls += 1;
+	last_rescan_distance = distance;
+	rescan_distances[bits] += 1;
+}
+Cache::Statistics Cache::get_statistics() const {
+	Statistics statistics = {};
+	root_node->collect_statistics(statistics, 0);
+	statistics.memory_usage = get_memory_usage();
+	statistics.highlight_calls = highlight_calls;
+	statistics.last_rescan_distance = last_rescan_distance;
+	statistics.rescan_distances = rescan_distances;
+	return statistics;
 }
 
+// spans are appended to a tentative log that backtracking truncates and that is only merged into the output at commit points
 class Spans {
 	std::vector<Span>& spans;
+	std::vector<Span> log;
 	std::size_t start;
 	int style;
 	void emit_span(std::size_t end, const Range& window) {
 		if (start == end || end <= window.start || start >= window.end || style == Style::DEFAULT) {
 			return;
 		}
-		if (spans.size() > 0) {
-			Span& last_span = spans.back();
-			if (last_span.end == start && last_span.style == style) {
-				last_span.end = std::min(end, window.end);
-				return;
-			}
-		}
-		spans.emplace_back(std::max(start, window.start), std::min(end, window.end), style);
+		log.emplace_back(std::max(start, window.start), std::min(end, window.end), style);
 	}
 public:
 	Spans(std::vector<Span>& spans): spans(spans), start(0), style(Style::DEFAULT) {}
+	void commit() {
+		for (const Span& span: log) {
+			if (spans.size() > 0) {
+				Span& last_span = spans.back();
+				if (last_span.end == span.start && last_span.style == span.style) {
+					last_span.end = span.end;
+					continue;
+				}
+			}
+			spans.push_back(span);
+		}
+		log.clear();
+	}
+	// the committed spans
+	std::vector<Span>& get_spans() {
+		return spans;
+	}
+	// ends the current span at pos and continues it from there
+	void split(std::size_t pos, const Range& window) {
+		emit_span(pos, window);
+		start = pos;
+	}
 	int change_style(std::size_t pos, int new_style, const Range& window) {
 		emit_span(pos, window);
 		start = pos;
@@ -145,15 +632,15 @@ public:
 		return old_style;
 	}
 	struct SavePoint {
-		std::size_t spans_size;
+		std::size_t log_size;
 		std::size_t start;
 		int style;
 	};
 	SavePoint save() const {
-		return {spans.size(), start, style};
+		return {log.size(), start, style};
 	}
 	void restore(const SavePoint& save_point) {
-		spans.erase(spans.begin() + save_point.spans_size, spans.end());
+		log.erase(log.begin() + save_point.log_size, log.end());
 		start = save_point.start;
 		style = save_point.style;
 	}
@@ -164,41 +651,91 @@ class Scope {
 	const void* expression;
 	std::size_t pos;
 	std::size_t max_pos;
-	Cache::Node* node;
-	std::size_t get_last_checkpoint() const {
-		return node ? node->get_last_checkpoint() : pos;
-	}
-	Cache::Node* find_child(const void* expression, std::size_t pos) const {
+	Cache* cache;
+	// the node may be shared with a snapshot until mutable_node is set
+	const Cache::Node* node;
+	Cache::Node* mutable_node;
+	std::size_t last_checkpoint;
+	// the node of the same scope in the cache from before an edit
+	const Cache::Node* old_node;
+	const Cache::Node* find_child(const void* expression, std::size_t pos) const {
 		return node ? node->find_child(expression, pos) : nullptr;
 	}
-	Cache::Node* ensure_node() {
-		if (node == nullptr) {
-			node = parent_scope->ensure_node()->add_child(expression, pos, max_pos);
+	// copies the path from the root to the node where it is shared
+	Cache::Node* get_mutable_node() {
+		if (mutable_node == nullptr) {
+			if (parent_scope == nullptr) {
+				mutable_node = cache->get_mutable_root_node();
+			}
+			else if (node) {
+				mutable_node = parent_scope->get_mutable_node()->find_mutable_child(expression, pos);
+			}
+			else {
+				mutable_node = parent_scope->get_mutable_node()->add_child(expression, pos, max_pos);
+			}
+			node = mutable_node;
 		}
-		return node;
+		return mutable_node;
 	}
 public:
-	Scope(Cache::Node* node): parent_scope(nullptr), expression(nullptr), pos(0), max_pos(0), node(node) {}
-	Scope(Scope* parent_scope, const void* expression, std::size_t pos, std::size_t max_pos): parent_scope(parent_scope), expression(expression), pos(pos), max_pos(max_pos), node(parent_scope->find_child(expression, pos)) {}
+	Scope(Cache& cache): parent_scope(nullptr), expression(nullptr), pos(0), max_pos(0), cache(&cache), node(cache.get_root_node()), mutable_node(nullptr), last_checkpoint(node->get_last_checkpoint()), old_node(nullptr) {}
+	Scope(Scope* parent_scope, const void* expression, std::size_t pos, std::size_t max_pos): parent_scope(parent_scope), expression(expression), pos(pos), max_pos(max_pos), cache(nullptr), node(parent_scope->find_child(expression, pos)), mutable_node(nullptr), last_checkpoint(node ? node->get_last_checkpoint() : pos), old_node(nullptr) {}
 	Scope* get_parent_scope() const {
 		return parent_scope;
 	}
-	void add_checkpoint(std::size_t pos, std::size_t max_pos) {
-		if (pos >= get_last_checkpoint() + 16) {
-			ensure_node()->add_checkpoint(pos, max_pos);
+	const void* get_expression() const {
+		return expression;
+	}
+	std::size_t get_start() const {
+		return pos;
+	}
+	void add_checkpoint(std::size_t pos, std::size_t max_pos, bool force = false) {
+		if (pos >= last_checkpoint + (force ? 1 : 16) && pos <= Cache::Checkpoint::MAX_POS) {
+			get_mutable_node()->add_checkpoint(pos, max_pos);
+			last_checkpoint = pos;
 		}
 	}
-	Cache::Checkpoint find_checkpoint(std::size_t pos) {
+	void graft(const Cache::Node& old_node, std::size_t old_pos, std::size_t pos, std::size_t min_max_pos) {
+		get_mutable_node()->graft(old_node, old_pos, pos, min_max_pos);
+	}
+	const Cache::Node* get_old_node() const {
+		return old_node;
+	}
+	void set_old_node(const Cache::Node* old_node) {
+		this->old_node = old_node;
+	}
+	// returns the position and max_pos to resume from
+	std::pair<std::size_t, std::size_t> find_checkpoint(std::size_t pos) {
 		if (node) {
 			const Cache::Checkpoint* checkpoint = node->find_checkpoint(pos);
 			if (checkpoint) {
-				return *checkpoint;
+				return {checkpoint->get_pos(), checkpoint->get_max_pos()};
 			}
 		}
 		return {this->pos, this->max_pos};
 	}
 };
 
+// the kind of a bracket is its opening char
+constexpr char get_bracket_kind(char c) {
+	switch (c) {
+	case '(':
+	case ')':
+		return '(';
+	case '[':
+	case ']':
+		return '[';
+	case '{':
+	case '}':
+		return '{';
+	default:
+		return '\0';
+	}
+}
+
+// the number of bytes between writes to a stream output
+constexpr std::size_t STREAM_STEP = 1 << 16;
+
 enum class Result: unsigned char {
 	FAILURE,
 	SUCCESS,
@@ -211,34 +748,188 @@ class ParseContext {
 	std::size_t max_pos;
 	Spans spans;
 	Scope* current_scope;
+	Cache* rescan_cache;
+	Structure* structure;
+	// delimiters found since the last commit
+	std::vector<Structure::Delimiter> delimiters;
+	std::size_t depth;
+	std::size_t max_depth;
+	const Budget* budget;
+	std::size_t resume_pos;
+	std::size_t steps;
+	bool stopped;
+	// snapshots from before the edit, the parse stops where it reaches one of the old checkpoints
+	const Cache::Node* old_root;
+	const Structure* old_structure;
+	const Edit* edit;
+	bool converged;
+	// checkpoints are not kept while streaming, the committed spans are written out instead
+	StreamOutput* stream_output;
+	std::size_t streamed;
+	// maps a new scope to its node in the old cache, using the node of its parent
+	const Cache::Node* find_old_node(const Scope* scope) const {
+		const Cache::Node* parent = scope->get_parent_scope()->get_old_node();
+		const std::size_t start = scope->get_start();
+		if (parent == nullptr || (start > edit->pos && start < edit->pos + edit->inserted)) {
+			return nullptr;
+		}
+		return parent->find_child(scope->get_expression(), start <= edit->pos ? start : start - edit->inserted + edit->removed);
+	}
+	bool has_converged() const {
+		const std::size_t pos = input.get_position();
+		// the scopes of a grafted tail need nodes, which cannot start past MAX_POS
+		if (pos < edit->pos + edit->inserted || pos > Cache::Checkpoint::MAX_POS) {
+			return false;
+		}
+		const Cache::Node* node = current_scope->get_old_node();
+		const std::size_t old_pos = pos - edit->inserted + edit->removed;
+		const Cache::Checkpoint* checkpoint = node ? node->find_checkpoint(old_pos) : nullptr;
+		return checkpoint && checkpoint->get_pos() == old_pos;
+	}
+	// after the point of convergence the old checkpoints, scopes and delimiters are still valid once they are moved by the edit
+	// the innermost scope is grafted first because grafting a scope can move the nodes of its children
+	void graft_old_tail(std::size_t max_pos) {
+		const std::size_t pos = input.get_position();
+		const std::size_t old_pos = pos - edit->inserted + edit->removed;
+		for (Scope* scope = current_scope; scope; scope = scope->get_parent_scope()) {
+			scope->graft(*scope->get_old_node(), old_pos, pos, max_pos);
+		}
+		if (structure) {
+			structure->graft(*old_structure, old_pos, pos);
+		}
+	}
 public:
-	ParseContext(const Input* input, std::vector<Span>& spans, std::size_t window_start, std::size_t window_end): input(input), window(window_start, window_end), max_pos(0), spans(spans), current_scope(nullptr) {}
-	char get() const {
+	ParseContext(const Input* input, std::vector<Span>& spans, std::size_t window_start, std::size_t window_end, std::size_t max_lookahead = SIZE_MAX): input(input, window_end + std::min(max_lookahead, SIZE_MAX - window_end)), window(window_start, window_end), max_pos(0), spans(spans), current_scope(nullptr), rescan_cache(nullptr), structure(nullptr), depth(0), max_depth(SIZE_MAX), budget(nullptr), resume_pos(0), steps(0), stopped(false), old_root(nullptr), old_structure(nullptr), edit(nullptr), converged(false), stream_output(nullptr), streamed(0) {}
+	char get() {
 		return input.get();
 	}
 	void advance() {
 		input.advance();
 	}
+	std::size_t get_position() const {
+		return input.get_position();
+	}
+	template <bool can_checkpoint, bool skips_brackets = false> bool skip(const CharScanner& scanner) {
+		const std::size_t pos = input.get_position();
+		const auto add_brackets = [this](std::size_t pos, const char* first, const char* last) {
+			if (skips_brackets && structure) {
+				for (const char* c = first; c != last; ++c) {
+					if (const char kind = get_bracket_kind(*c)) {
+						delimiters.push_back({pos + (c - first), 1, Structure::NONE, Structure::NONE, kind, *c == kind});
+					}
+				}
+			}
+		};
+		if constexpr (can_checkpoint) {
+			input.skip(scanner, std::min(std::max(window.end, pos + 1), pos + 4096), add_brackets);
+		}
+		else {
+			input.skip(scanner, SIZE_MAX, add_brackets);
+		}
+		return input.get_position() != pos;
+	}
 	int change_style(int new_style) {
 		return spans.change_style(input.get_position(), new_style, window);
 	}
+	// delimiters that were found with a truncated input are discarded
+	void commit() {
+		spans.commit();
+		if (structure) {
+			if (!input.is_cut_off()) {
+				structure->append(delimiters, input.get_position());
+			}
+			delimiters.clear();
+		}
+	}
+	void add_delimiter(std::size_t start, char kind, bool open) {
+		if (structure) {
+			delimiters.push_back({start, static_cast<std::uint32_t>(input.get_position() - start), Structure::NONE, Structure::NONE, kind, open});
+		}
+	}
 	bool add_checkpoint() {
-		current_scope->add_checkpoint(input.get_position(), std::max(max_pos, input.get_position()));
-		return input.get_position() >= window.end;
+		commit();
+		if (stream_output) {
+			if (input.get_position() >= streamed + STREAM_STEP) {
+				streamed = input.get_position();
+				spans.split(streamed, window);
+				spans.commit();
+				stream_output->write(spans.get_spans(), streamed);
+				spans.get_spans().clear();
+			}
+			return false;
+		}
+		if (budget && input.get_position() > resume_pos && input.get_position() < window.end) {
+			++steps;
+			stopped = budget->is_exhausted(steps, steps % 256 == 0);
+		}
+		if (old_root && !stopped && has_converged()) {
+			stopped = converged = true;
+			if (!input.is_cut_off()) {
+				current_scope->add_checkpoint(input.get_position(), std::max(max_pos, input.get_examined_end()), true);
+				graft_old_tail(std::max(max_pos, input.get_examined_end()));
+			}
+			return true;
+		}
+		if (!input.is_cut_off()) {
+			current_scope->add_checkpoint(input.get_position(), std::max(max_pos, input.get_examined_end()), stopped);
+		}
+		return stopped || input.get_position() >= window.end;
+	}
+	// steps are only counted after resume_pos so that every budgeted call makes progress
+	void set_budget(const Budget* budget, std::size_t resume_pos) {
+		this->budget = budget;
+		this->resume_pos = resume_pos;
+	}
+	bool is_stopped() const {
+		return stopped;
+	}
+	void set_old_cache(const Cache::Node* old_root, const Structure* old_structure, const Edit* edit) {
+		this->old_root = old_root;
+		this->old_structure = old_structure;
+		this->edit = edit;
+	}
+	bool is_converged() const {
+		return converged;
+	}
+	void set_stream_output(StreamOutput* stream_output) {
+		this->stream_output = stream_output;
 	}
 	void skip_to_checkpoint() {
 		const auto checkpoint = current_scope->find_checkpoint(window.start);
-		input.set_position(checkpoint.pos);
-		max_pos = checkpoint.max_pos;
+		if (rescan_cache) {
+			rescan_cache->add_rescan_distance(window.start - std::min(window.start, checkpoint.first));
+			rescan_cache = nullptr;
+		}
+		if (checkpoint.first != input.get_position()) {
+			input.prefetch(checkpoint.first, window.end);
+		}
+		input.set_position(checkpoint.first);
+		max_pos = checkpoint.second;
+	}
+	template <class F> Result enter_reference(F f) {
+		if (depth == max_depth) {
+			return Result::FAILURE;
+		}
+		++depth;
+		const Result result = f();
+		--depth;
+		return result;
 	}
 	template <class F> void add_root_scope(Cache& cache, F f) {
-		Scope root_scope(cache.get_root_node());
+		max_depth = cache.get_max_depth();
+		rescan_cache = &cache;
+		structure = cache.get_structure().is_enabled() ? &cache.get_structure() : nullptr;
+		Scope root_scope(cache);
+		root_scope.set_old_node(old_root);
 		current_scope = &root_scope;
 		f();
 		current_scope = nullptr;
 	}
 	template <class F> Result add_scope(const void* expression, F f) {
-		Scope scope(current_scope, expression, input.get_position(), std::max(max_pos, input.get_position()));
+		Scope scope(current_scope, expression, input.get_position(), std::max(max_pos, input.get_examined_end()));
+		if (old_root) {
+			scope.set_old_node(find_old_node(&scope));
+		}
 		current_scope = &scope;
 		const Result result = f();
 		current_scope = scope.get_parent_scope();
@@ -248,13 +939,48 @@ public:
 		std::size_t pos;
 		Spans::SavePoint spans;
 	};
-	SavePoint save() const {
-		return {input.get_position(), spans.save()};
+	template <bool save_spans = true> auto save() const {
+		if constexpr (save_spans) {
+			return SavePoint{input.get_position(), spans.save()};
+		}
+		else {
+			return input.get_position();
+		}
 	}
 	void restore(const SavePoint& save_point) {
-		max_pos = std::max(max_pos, input.get_position());
+		max_pos = std::max(max_pos, input.get_examined_end());
 		input.set_position(save_point.pos);
 		spans.restore(save_point.spans);
+		// delimiters are logged in order, so the ones after the save point are at the end
+		while (!delimiters.empty() && delimiters.back().start >= save_point.pos) {
+			delimiters.pop_back();
+		}
+	}
+	void restore(std::size_t pos) {
+		max_pos = std::max(max_pos, input.get_examined_end());
+		input.set_position(pos);
+	}
+};
+
+// describes the behavior of an expression depending on the next char
+struct FirstChars {
+	// chars for which the expression might do more than succeed or fail without consuming anything
+	CharSet any;
+	// chars for which the expression succeeds without consuming anything
+	CharSet empty;
+	// chars which the expression consumes on their own, without emitting any spans
+	CharSet single;
+};
+
+class Equals {
+	char c;
+public:
+	constexpr Equals(char c): c(c) {}
+	constexpr char get_char() const {
+		return c;
+	}
+	constexpr bool operator ()(char i) const {
+		return i == c;
 	}
 };
 
@@ -264,7 +990,33 @@ public:
 	static constexpr bool always_succeeds() {
 		return false;
 	}
+	static constexpr bool emits_spans() {
+		return false;
+	}
 	constexpr Char(F f): f(f) {}
+	constexpr const F& get_function() const {
+		return f;
+	}
+	constexpr CharSet get_chars() const {
+		if constexpr (std::is_same_v<F, CharSet>) {
+			return f;
+		}
+		else if constexpr (std::is_same_v<F, Equals>) {
+			CharSet chars;
+			chars.insert(f.get_char());
+			return chars;
+		}
+		else {
+			return CharSet::from_function(f);
+		}
+	}
+	constexpr FirstChars get_first_chars() const {
+		const CharSet chars = get_chars();
+		return {chars, CharSet(), chars};
+	}
+	constexpr Char optimize() const {
+		return *this;
+	}
 	template <bool can_checkpoint> Result parse(ParseContext& context) const {
 		if (!f(context.get())) {
 			return Result::FAILURE;
@@ -280,7 +1032,21 @@ public:
 	static constexpr bool always_succeeds() {
 		return false;
 	}
+	static constexpr bool emits_spans() {
+		return false;
+	}
 	constexpr String(const char* string): string(string) {}
+	constexpr FirstChars get_first_chars() const {
+		if (*string == '\0') {
+			return {CharSet(), CharSet::all(), CharSet()};
+		}
+		CharSet chars;
+		chars.insert(*string);
+		return {chars, CharSet(), string[1] == '\0' ? chars : CharSet()};
+	}
+	constexpr String optimize() const {
+		return *this;
+	}
 	template <bool can_checkpoint> Result parse(ParseContext& context) const {
 		if (*string == '\0') {
 			return Result::SUCCESS;
@@ -288,7 +1054,7 @@ public:
 		if (context.get() != *string) {
 			return Result::FAILURE;
 		}
-		const auto save_point = context.save();
+		const auto save_point = context.save<false>();
 		context.advance();
 		for (const char* s = string + 1; *s != '\0'; ++s) {
 			if (context.get() != *s) {
@@ -301,6 +1067,49 @@ public:
 	}
 };
 
+template <std::size_t N> class StaticString {
+	char string[N];
+public:
+	static constexpr bool always_succeeds() {
+		return false;
+	}
+	static constexpr bool emits_spans() {
+		return false;
+	}
+	constexpr StaticString(const Char<Equals>& c0, const Char<Equals>& c1): string{c0.get_function().get_char(), c1.get_function().get_char()} {}
+	constexpr StaticString(const Char<Equals>& c, const StaticString<N - 1>& s): string{c.get_function().get_char()} {
+		for (std::size_t i = 1; i < N; ++i) {
+			string[i] = s[i - 1];
+		}
+	}
+	constexpr char operator [](std::size_t i) const {
+		return string[i];
+	}
+	constexpr FirstChars get_first_chars() const {
+		CharSet chars;
+		chars.insert(string[0]);
+		return {chars, CharSet(), CharSet()};
+	}
+	constexpr StaticString optimize() const {
+		return *this;
+	}
+	template <bool can_checkpoint> Result parse(ParseContext& context) const {
+		if (context.get() != string[0]) {
+			return Result::FAILURE;
+		}
+		const auto save_point = context.save<false>();
+		context.advance();
+		for (std::size_t i = 1; i < N; ++i) {
+			if (context.get() != string[i]) {
+				context.restore(save_point);
+				return Result::FAILURE;
+			}
+			context.advance();
+		}
+		return Result::SUCCESS;
+	}
+};
+
 class CaseInsensitiveString {
 	const char* string;
 	static constexpr char to_lower(char c) {
@@ -310,9 +1119,25 @@ public:
 	static constexpr bool always_succeeds() {
 		return false;
 	}
+	static constexpr bool emits_spans() {
+		return false;
+	}
 	constexpr CaseInsensitiveString(const char* string): string(string) {}
+	constexpr FirstChars get_first_chars() const {
+		if (*string == '\0') {
+			return {CharSet(), CharSet::all(), CharSet()};
+		}
+		const char c = to_lower(*string);
+		const CharSet chars = CharSet::from_function([c](char i) {
+			return to_lower(i) == c;
+		});
+		return {chars, CharSet(), string[1] == '\0' ? chars : CharSet()};
+	}
+	constexpr CaseInsensitiveString optimize() const {
+		return *this;
+	}
 	template <bool can_checkpoint> Result parse(ParseContext& context) const {
-		const auto save_point = context.save();
+		const auto save_point = context.save<false>();
 		for (const char* s = string; *s != '\0'; ++s) {
 			if (to_lower(context.get()) != to_lower(*s)) {
 				context.restore(save_point);
@@ -330,7 +1155,22 @@ public:
 	static constexpr bool always_succeeds() {
 		return true;
 	}
+	static constexpr bool emits_spans() {
+		return false;
+	}
 	constexpr Sequence() {}
+	constexpr FirstChars get_first_chars() const {
+		return {CharSet(), CharSet::all(), CharSet()};
+	}
+	constexpr Sequence optimize_elements() const {
+		return *this;
+	}
+	constexpr Sequence optimize() const {
+		return *this;
+	}
+	template <bool can_checkpoint, class S> Result parse_rest(ParseContext& context, const S& save_point) const {
+		return Result::SUCCESS;
+	}
 	template <bool can_checkpoint> Result parse(ParseContext& context) const {
 		return Result::SUCCESS;
 	}
@@ -342,30 +1182,109 @@ public:
 	static constexpr bool always_succeeds() {
 		return T0::always_succeeds() && Sequence<T...>::always_succeeds();
 	}
+	static constexpr bool emits_spans() {
+		return T0::emits_spans() || Sequence<T...>::emits_spans();
+	}
 	constexpr Sequence(T0 t0, T... t): t0(t0), t(t...) {}
-	template <bool can_checkpoint> Result parse(ParseContext& context) const {
-		const auto save_point = context.save();
+	constexpr Sequence(T0 t0, Sequence<T...> t): t0(t0), t(t) {}
+	constexpr const T0& get_first() const {
+		return t0;
+	}
+	constexpr const Sequence<T...>& get_rest() const {
+		return t;
+	}
+	constexpr FirstChars get_first_chars() const {
+		const FirstChars first = t0.get_first_chars();
+		const FirstChars rest = t.get_first_chars();
+		return {
+			first.any | (first.empty & rest.any),
+			first.empty & rest.empty,
+			(first.empty & rest.single) | (~rest.empty ? CharSet() : first.single)
+		};
+	}
+	constexpr auto optimize_elements() const;
+	constexpr auto optimize() const;
+	template <bool can_checkpoint, class S> Result parse_rest(ParseContext& context, const S& save_point) const {
 		const Result result = t0.template parse<can_checkpoint && Sequence<T...>::always_succeeds()>(context);
 		if (result != Result::SUCCESS) {
-			return result;
-		}
-		{
-			const Result result = t.template parse<can_checkpoint>(context);
 			if (result == Result::FAILURE) {
 				context.restore(save_point);
 			}
 			return result;
 		}
+		return t.template parse_rest<can_checkpoint>(context, save_point);
+	}
+	template <bool can_checkpoint> Result parse(ParseContext& context) const {
+		if constexpr (Sequence<T...>::always_succeeds()) {
+			const Result result = t0.template parse<can_checkpoint>(context);
+			if (result != Result::SUCCESS) {
+				return result;
+			}
+			return t.template parse<can_checkpoint>(context);
+		}
+		else {
+			const auto save_point = context.save<emits_spans()>();
+			const Result result = t0.template parse<false>(context);
+			if (result != Result::SUCCESS) {
+				return result;
+			}
+			return t.template parse_rest<can_checkpoint>(context, save_point);
+		}
 	}
 };
 
+template <class T, class... R> constexpr Sequence<T, R...> prepend_sequence_element(const T& t, const Sequence<R...>& rest) {
+	return Sequence<T, R...>(t, rest);
+}
+template <class... R> constexpr Sequence<R...> prepend_sequence_element(const Sequence<>& sequence, const Sequence<R...>& rest) {
+	return rest;
+}
+template <class T0, class... T, class... R> constexpr auto prepend_sequence_element(const Sequence<T0, T...>& sequence, const Sequence<R...>& rest) {
+	return prepend_sequence_element(sequence.get_first(), prepend_sequence_element(sequence.get_rest(), rest));
+}
+template <class... R> constexpr Sequence<StaticString<2>, R...> prepend_sequence_element(const Char<Equals>& c, const Sequence<Char<Equals>, R...>& rest) {
+	return Sequence<StaticString<2>, R...>(StaticString<2>(c, rest.get_first()), rest.get_rest());
+}
+template <std::size_t N, class... R> constexpr Sequence<StaticString<N + 1>, R...> prepend_sequence_element(const Char<Equals>& c, const Sequence<StaticString<N>, R...>& rest) {
+	return Sequence<StaticString<N + 1>, R...>(StaticString<N + 1>(c, rest.get_first()), rest.get_rest());
+}
+template <class T0, class... T> constexpr auto Sequence<T0, T...>::optimize_elements() const {
+	return prepend_sequence_element(t0.optimize(), t.optimize_elements());
+}
+template <class T> constexpr T unwrap_sequence(const Sequence<T>& sequence) {
+	return sequence.get_first();
+}
+template <class... T> constexpr Sequence<T...> unwrap_sequence(const Sequence<T...>& sequence) {
+	return sequence;
+}
+template <class T0, class... T> constexpr auto Sequence<T0, T...>::optimize() const {
+	return unwrap_sequence(optimize_elements());
+}
+
 template <class... T> class Choice;
+template <class... T> class DispatchChoice;
 template <> class Choice<> {
 public:
 	static constexpr bool always_succeeds() {
 		return false;
 	}
+	static constexpr bool emits_spans() {
+		return false;
+	}
 	constexpr Choice() {}
+	constexpr FirstChars get_first_chars() const {
+		return {CharSet(), CharSet(), CharSet()};
+	}
+	constexpr void get_alternative_first_chars(FirstChars* first_chars) const {}
+	constexpr Choice optimize_alternatives() const {
+		return *this;
+	}
+	constexpr Choice optimize() const {
+		return *this;
+	}
+	template <bool can_checkpoint, std::size_t I> Result parse_candidates(ParseContext& context, const std::uint64_t* candidates) const {
+		return Result::FAILURE;
+	}
 	template <bool can_checkpoint> Result parse(ParseContext& context) const {
 		return Result::FAILURE;
 	}
@@ -377,7 +1296,41 @@ public:
 	static constexpr bool always_succeeds() {
 		return T0::always_succeeds() || Choice<T...>::always_succeeds();
 	}
+	static constexpr bool emits_spans() {
+		return T0::emits_spans() || Choice<T...>::emits_spans();
+	}
 	constexpr Choice(T0 t0, T... t): t0(t0), t(t...) {}
+	constexpr Choice(T0 t0, Choice<T...> t): t0(t0), t(t) {}
+	constexpr const T0& get_first() const {
+		return t0;
+	}
+	constexpr const Choice<T...>& get_rest() const {
+		return t;
+	}
+	constexpr FirstChars get_first_chars() const {
+		const FirstChars first = t0.get_first_chars();
+		const FirstChars rest = t.get_first_chars();
+		return {
+			first.any | (rest.any - first.empty),
+			first.empty | (rest.empty - first.any),
+			first.single | (rest.single - first.any - first.empty)
+		};
+	}
+	constexpr void get_alternative_first_chars(FirstChars* first_chars) const {
+		*first_chars = t0.get_first_chars();
+		t.get_alternative_first_chars(first_chars + 1);
+	}
+	constexpr auto optimize_alternatives() const;
+	constexpr auto optimize() const;
+	template <bool can_checkpoint, std::size_t I> Result parse_candidates(ParseContext& context, const std::uint64_t* candidates) const {
+		if ((candidates[I / 64] >> (I % 64)) & 1) {
+			const Result result = t0.template parse<can_checkpoint>(context);
+			if (result != Result::FAILURE) {
+				return result;
+			}
+		}
+		return t.template parse_candidates<can_checkpoint, I + 1>(context, candidates);
+	}
 	template <bool can_checkpoint> Result parse(ParseContext& context) const {
 		const Result result = t0.template parse<can_checkpoint>(context);
 		if (result != Result::FAILURE) {
@@ -387,13 +1340,149 @@ public:
 	}
 };
 
+// a choice that only tries the alternatives that can match the next char
+template <class... T> class DispatchChoice {
+	static constexpr std::size_t WORDS = (sizeof...(T) + 63) / 64;
+	Choice<T...> choice;
+	std::uint64_t candidates[256][WORDS];
+public:
+	static constexpr bool always_succeeds() {
+		return Choice<T...>::always_succeeds();
+	}
+	static constexpr bool emits_spans() {
+		return Choice<T...>::emits_spans();
+	}
+	constexpr DispatchChoice(Choice<T...> choice): choice(choice), candidates{} {
+		FirstChars first_chars[sizeof...(T)] = {};
+		choice.get_alternative_first_chars(first_chars);
+		for (int c = 0; c < 256; ++c) {
+			for (std::size_t i = 0; i < sizeof...(T); ++i) {
+				if (first_chars[i].any.contains(c) || first_chars[i].empty.contains(c)) {
+					candidates[c][i / 64] |= std::uint64_t(1) << (i % 64);
+				}
+				if (first_chars[i].empty.contains(c) && !first_chars[i].any.contains(c)) {
+					break;
+				}
+			}
+		}
+	}
+	constexpr const Choice<T...>& get_choice() const {
+		return choice;
+	}
+	constexpr FirstChars get_first_chars() const {
+		return choice.get_first_chars();
+	}
+	constexpr DispatchChoice optimize() const {
+		return *this;
+	}
+	template <bool can_checkpoint> Result parse(ParseContext& context) const {
+		return choice.template parse_candidates<can_checkpoint, 0>(context, candidates[static_cast<unsigned char>(context.get())]);
+	}
+};
+
+template <class T, class... R> constexpr Choice<T, R...> prepend_choice_element(const T& t, const Choice<R...>& rest) {
+	return Choice<T, R...>(t, rest);
+}
+template <class... R> constexpr Choice<R...> prepend_choice_element(const Choice<>& choice, const Choice<R...>& rest) {
+	return rest;
+}
+template <class T0, class... T, class... R> constexpr auto prepend_choice_element(const Choice<T0, T...>& choice, const Choice<R...>& rest) {
+	return prepend_choice_element(choice.get_first(), prepend_choice_element(choice.get_rest(), rest));
+}
+template <class... T, class... R> constexpr auto prepend_choice_element(const DispatchChoice<T...>& choice, const Choice<R...>& rest) {
+	return prepend_choice_element(choice.get_choice(), rest);
+}
+template <class F0, class F1, class... R> constexpr Choice<Char<CharSet>, R...> prepend_choice_element(const Char<F0>& c, const Choice<Char<F1>, R...>& rest) {
+	return Choice<Char<CharSet>, R...>(Char<CharSet>(c.get_chars() | rest.get_first().get_chars()), rest.get_rest());
+}
+template <class T0, class... T> constexpr auto Choice<T0, T...>::optimize_alternatives() const {
+	return prepend_choice_element(t0.optimize(), t.optimize_alternatives());
+}
+template <class T> constexpr T unwrap_choice(const Choice<T>& choice) {
+	return choice.get_first();
+}
+template <class T0, class T1> constexpr Choice<T0, T1> unwrap_choice(const Choice<T0, T1>& choice) {
+	return choice;
+}
+template <class... T> constexpr DispatchChoice<T...> unwrap_choice(const Choice<T...>& choice) {
+	return DispatchChoice<T...>(choice);
+}
+template <class T0, class... T> constexpr auto Choice<T0, T...>::optimize() const {
+	return unwrap_choice(optimize_alternatives());
+}
+
+// any of ()[]{} as a delimiter, repetitions record the ones they skip over
+class Brackets {
+public:
+	static constexpr bool always_succeeds() {
+		return false;
+	}
+	static constexpr bool emits_spans() {
+		return true;
+	}
+	constexpr Brackets() {}
+	constexpr FirstChars get_first_chars() const {
+		const CharSet chars = CharSet::from_function([](char c) {
+			return get_bracket_kind(c) != '\0';
+		});
+		return {chars, CharSet(), chars};
+	}
+	constexpr Brackets optimize() const {
+		return *this;
+	}
+	template <bool can_checkpoint> Result parse(ParseContext& context) const {
+		const char c = context.get();
+		const char kind = get_bracket_kind(c);
+		if (kind == '\0') {
+			return Result::FAILURE;
+		}
+		const std::size_t start = context.get_position();
+		context.advance();
+		context.add_delimiter(start, kind, c == kind);
+		return Result::SUCCESS;
+	}
+};
+
+template <std::size_t MIN_REPETITIONS, std::size_t MAX_REPETITIONS, class T> class Repetition;
+// whether the chars skipped by a repetition of T might be brackets
+template <class T> struct SkipsBrackets: std::false_type {};
+template <> struct SkipsBrackets<Brackets>: std::true_type {};
+template <class... T> struct SkipsBrackets<Choice<T...>>: std::disjunction<SkipsBrackets<T>...> {};
+template <class... T> struct SkipsBrackets<DispatchChoice<T...>>: std::disjunction<SkipsBrackets<T>...> {};
+template <class... T> struct SkipsBrackets<Sequence<T...>>: std::disjunction<SkipsBrackets<T>...> {};
+template <std::size_t MIN_REPETITIONS, class T> struct SkipsBrackets<Repetition<MIN_REPETITIONS, 1, T>>: SkipsBrackets<T> {};
+
 template <std::size_t MIN_REPETITIONS, std::size_t MAX_REPETITIONS, class T> class Repetition {
 	T t;
+	FirstChars first_chars;
+	CharScanner scanner;
 public:
 	static constexpr bool always_succeeds() {
 		return MIN_REPETITIONS == 0 || T::always_succeeds();
 	}
-	constexpr Repetition(T t): t(t) {}
+	static constexpr bool emits_spans() {
+		return T::emits_spans();
+	}
+	constexpr Repetition(T t): t(t), first_chars(t.get_first_chars()), scanner(MAX_REPETITIONS == 0 ? first_chars.single : CharSet()) {}
+	constexpr auto optimize() const {
+		return Repetition<MIN_REPETITIONS, MAX_REPETITIONS, decltype(t.optimize())>(t.optimize());
+	}
+	constexpr FirstChars get_first_chars() const {
+		if constexpr (MAX_REPETITIONS == 1) {
+			if constexpr (MIN_REPETITIONS == 0) {
+				return {first_chars.any, ~first_chars.any, first_chars.single};
+			}
+			else {
+				return first_chars;
+			}
+		}
+		else if constexpr (MIN_REPETITIONS == 0) {
+			return {first_chars.any | first_chars.empty, ~(first_chars.any | first_chars.empty), CharSet()};
+		}
+		else {
+			return {first_chars.any | first_chars.empty, CharSet(), CharSet()};
+		}
+	}
 	template <bool can_checkpoint> Result parse(ParseContext& context) const {
 		if constexpr (MIN_REPETITIONS == 1) {
 			const Result result = t.template parse<can_checkpoint>(context);
@@ -402,7 +1491,7 @@ public:
 			}
 		}
 		else if constexpr (MIN_REPETITIONS > 1) {
-			const auto save_point = context.save();
+			const auto save_point = context.save<T::emits_spans()>();
 			for (std::size_t i = 0; i < MIN_REPETITIONS; ++i) {
 				const Result result = t.template parse<can_checkpoint && T::always_succeeds()>(context);
 				if (result != Result::SUCCESS) {
@@ -418,6 +1507,9 @@ public:
 			return context.add_scope(this, [&]() {
 				context.skip_to_checkpoint();
 				for (std::size_t i = MIN_REPETITIONS; (MAX_REPETITIONS == 0 || i < MAX_REPETITIONS); ++i) {
+					if (scanner && context.template skip<can_checkpoint, SkipsBrackets<T>::value>(scanner) && context.add_checkpoint()) {
+						return Result::PARTIAL_SUCCESS;
+					}
 					const Result result = t.template parse<can_checkpoint>(context);
 					if (result != Result::SUCCESS) {
 						return result == Result::FAILURE ? Result::SUCCESS : result;
@@ -431,6 +1523,9 @@ public:
 		}
 		else {
 			for (std::size_t i = MIN_REPETITIONS; MAX_REPETITIONS == 0 || i < MAX_REPETITIONS; ++i) {
+				if (scanner) {
+					context.template skip<can_checkpoint, SkipsBrackets<T>::value>(scanner);
+				}
 				const Result result = t.template parse<can_checkpoint>(context);
 				if (result != Result::SUCCESS) {
 					return result == Result::FAILURE ? Result::SUCCESS : result;
@@ -447,9 +1542,19 @@ public:
 	static constexpr bool always_succeeds() {
 		return T::always_succeeds();
 	}
+	static constexpr bool emits_spans() {
+		return T::emits_spans();
+	}
 	constexpr And(T t): t(t) {}
+	constexpr FirstChars get_first_chars() const {
+		const FirstChars first = t.get_first_chars();
+		return {first.any, first.empty, CharSet()};
+	}
+	constexpr auto optimize() const {
+		return And<decltype(t.optimize())>(t.optimize());
+	}
 	template <bool can_checkpoint> Result parse(ParseContext& context) const {
-		const auto save_point = context.save();
+		const auto save_point = context.save<T::emits_spans()>();
 		if (t.template parse<false>(context) == Result::SUCCESS) {
 			context.restore(save_point);
 			return Result::SUCCESS;
@@ -466,9 +1571,19 @@ public:
 	static constexpr bool always_succeeds() {
 		return false;
 	}
+	static constexpr bool emits_spans() {
+		return T::emits_spans();
+	}
 	constexpr Not(T t): t(t) {}
+	constexpr FirstChars get_first_chars() const {
+		const FirstChars first = t.get_first_chars();
+		return {first.any, ~first.any - first.empty, CharSet()};
+	}
+	constexpr auto optimize() const {
+		return Not<decltype(t.optimize())>(t.optimize());
+	}
 	template <bool can_checkpoint> Result parse(ParseContext& context) const {
-		const auto save_point = context.save();
+		const auto save_point = context.save<T::emits_spans()>();
 		if (t.template parse<false>(context) == Result::SUCCESS) {
 			context.restore(save_point);
 			return Result::FAILURE;
@@ -485,7 +1600,17 @@ public:
 	static constexpr bool always_succeeds() {
 		return T::always_succeeds();
 	}
+	static constexpr bool emits_spans() {
+		return true;
+	}
 	constexpr Highlight(T t): t(t) {}
+	constexpr FirstChars get_first_chars() const {
+		const FirstChars first = t.get_first_chars();
+		return {first.any, first.empty, CharSet()};
+	}
+	constexpr auto optimize() const {
+		return Highlight<style, decltype(t.optimize())>(t.optimize());
+	}
 	template <bool can_checkpoint> Result parse(ParseContext& context) const {
 		const int old_style = context.change_style(style);
 		const Result result = t.template parse<can_checkpoint>(context);
@@ -494,20 +1619,61 @@ public:
 	}
 };
 
+// records a delimiter when t matches, emits_spans covers the delimiters so that backtracking discards them
+template <char kind, bool open, class T> class Delimiter {
+	T t;
+public:
+	static constexpr bool always_succeeds() {
+		return T::always_succeeds();
+	}
+	static constexpr bool emits_spans() {
+		return true;
+	}
+	constexpr Delimiter(T t): t(t) {}
+	constexpr FirstChars get_first_chars() const {
+		const FirstChars first = t.get_first_chars();
+		return {first.any, first.empty, CharSet()};
+	}
+	constexpr auto optimize() const {
+		return Delimiter<kind, open, decltype(t.optimize())>(t.optimize());
+	}
+	template <bool can_checkpoint> Result parse(ParseContext& context) const {
+		const std::size_t start = context.get_position();
+		const Result result = t.template parse<can_checkpoint>(context);
+		if (result == Result::SUCCESS) {
+			context.add_delimiter(start, kind, open);
+		}
+		return result;
+	}
+};
+
+template <class T> struct Optimized {
+	static constexpr auto expression = T::expression.optimize();
+};
+
 template <class T> class Reference {
 public:
 	static constexpr bool always_succeeds() {
 		return decltype(T::expression)::always_succeeds();
 	}
+	static constexpr bool emits_spans() {
+		return true;
+	}
+	constexpr FirstChars get_first_chars() const {
+		return {CharSet::all(), CharSet(), CharSet()};
+	}
+	constexpr Reference optimize() const {
+		return *this;
+	}
 	template <bool can_checkpoint> Result parse(ParseContext& context) const {
-		return T::expression.template parse<can_checkpoint>(context);
+		return context.enter_reference([&]() {
+			return Optimized<T>::expression.template parse<can_checkpoint>(context);
+		});
 	}
 };
 
-constexpr auto get_expression(char c) {
-	return Char([c](char i) {
-		return i == c;
-	});
+constexpr Char<Equals> get_expression(char c) {
+	return Char(Equals(c));
 }
 constexpr String get_expression(const char* s) {
 	return String(s);
@@ -581,6 +1747,15 @@ template <class T> constexpr auto ends_with(T t) {
 	const auto e = sequence(t, end());
 	return sequence(repetition(any_char_but(e)), e);
 }
+template <char kind, class T> constexpr auto opening_delimiter(T t) {
+	return Delimiter<kind, true, decltype(get_expression(t))>(get_expression(t));
+}
+template <char kind, class T> constexpr auto closing_delimiter(T t) {
+	return Delimiter<kind, false, decltype(get_expression(t))>(get_expression(t));
+}
+constexpr Brackets brackets() {
+	return Brackets();
+}
 template <class T> constexpr auto reference() {
 	return Reference<T>();
 }
@@ -596,7 +1771,7 @@ template <class S, class E, class... T> constexpr auto nested_scope(int style, S
 	));
 }
 template <class T> constexpr auto root_scope(T t) {
-	return repetition(choice(t, any_char()));
+	return repetition(choice(t, brackets(), any_char()));
 }
 
 struct Language {
@@ -612,7 +1787,8 @@ template <class parse_file_name, class parse> constexpr Language language(const
 			return reference<parse_file_name>().template parse<false>(context) == Result::SUCCESS;
 		},
 		[](ParseContext& context) {
-			root_scope(reference<parse>()).template parse<true>(context);
+			static constexpr auto expression = root_scope(parse::expression).optimize();
+			expression.template parse<true>(context);
 		}
 	};
 }
@@ -649,6 +1825,7 @@ const Language* prism::get_language(const char* file_name) {
 	StringInput input(file_name);
 	std::vector<Span> spans;
 	ParseContext context(&input, spans, 0, input.size());
+	context.restore(0);
 	for (const Language& language: languages) {
 		if (language.parse_file_name(context)) {
 			return &language;
@@ -657,12 +1834,324 @@ const Language* prism::get_language(const char* file_name) {
 	return nullptr;
 }
 
-std::vector<Span> prism::highlight(const Language* language, const Input* input, Cache& cache, std::size_t window_start, std::size_t window_end) {
+static std::vector<Span> highlight_window(const Language* language, const Input* input, Cache& cache, std::size_t window_start, std::size_t window_end, std::size_t max_lookahead) {
 	std::vector<Span> spans;
-	ParseContext context(input, spans, window_start, window_end);
+	ParseContext context(input, spans, window_start, window_end, max_lookahead);
 	context.add_root_scope(cache, [&]() {
 		language->parse(context);
 	});
 	context.change_style(Style::DEFAULT);
+	context.commit();
+	return spans;
+}
+
+std::vector<Span> prism::highlight(const Language* language, const Input* input, Cache& cache, std::size_t window_start, std::size_t window_end, std::size_t max_lookahead) {
+	// spans found with a limited lookahead may change once the parse sees more
+	if (cache.get_span_cache_size() == 0 || max_lookahead != SIZE_MAX) {
+		return highlight_window(language, input, cache, window_start, window_end, max_lookahead);
+	}
+	// only the parts of the window that are not in a span run are parsed
+	std::vector<Span> spans;
+	std::size_t pos = window_start;
+	while (pos < window_end) {
+		const Cache::SpanRun* run = cache.find_span_run(pos);
+		if (run && run->range.start <= pos) {
+			const Range range(pos, std::min(run->range.end, window_end));
+			append_spans(spans, run->spans, range);
+			pos = range.end;
+		}
+		else {
+			const Range range(pos, run ? std::min(run->range.start, window_end) : window_end);
+			const std::vector<Span> new_spans = highlight_window(language, input, cache, range.start, range.end, max_lookahead);
+			append_spans(spans, new_spans, range);
+			cache.add_span_run(range, new_spans);
+			pos = range.end;
+		}
+	}
+	cache.trim_span_runs(Range(window_start, window_end));
 	return spans;
 }
+
+std::vector<std::vector<Span>> prism::highlight(const Language* language, const Input* input, Cache& cache, const std::vector<Range>& windows, std::size_t max_lookahead) {
+	// parsing a gap this small is cheaper than descending from the root again
+	constexpr std::size_t MERGE_DISTANCE = 256;
+	std::vector<std::vector<Span>> result(windows.size());
+	std::size_t first = 0;
+	while (first < windows.size()) {
+		Range group = windows[first];
+		std::size_t last = first + 1;
+		while (last < windows.size() && (windows[last].start <= group.end || windows[last].start - group.end <= MERGE_DISTANCE)) {
+			group = group | windows[last];
+			++last;
+		}
+		const std::vector<Span> spans = highlight(language, input, cache, group.start, group.end, max_lookahead);
+		for (std::size_t i = first; i < last; ++i) {
+			append_spans(result[i], spans, windows[i]);
+		}
+		first = last;
+	}
+	return result;
+}
+
+// appends the parts of the range where the spans have a different style, joining adjacent ranges
+static void append_style_changes(std::vector<Range>& changes, const std::vector<Span>& old_spans, const std::vector<Span>& new_spans, const Range& range) {
+	auto old_span = old_spans.begin();
+	auto new_span = new_spans.begin();
+	std::size_t pos = range.start;
+	while (pos < range.end) {
+		while (old_span != old_spans.end() && old_span->end <= pos) {
+			++old_span;
+		}
+		while (new_span != new_spans.end() && new_span->end <= pos) {
+			++new_span;
+		}
+		// the style at pos and the next position where it might change
+		const bool in_old_span = old_span != old_spans.end() && old_span->start <= pos;
+		const bool in_new_span = new_span != new_spans.end() && new_span->start <= pos;
+		const int old_style = in_old_span ? old_span->style : Style::DEFAULT;
+		const int new_style = in_new_span ? new_span->style : Style::DEFAULT;
+		std::size_t next = range.end;
+		if (old_span != old_spans.end()) {
+			next = std::min(next, in_old_span ? old_span->end : old_span->start);
+		}
+		if (new_span != new_spans.end()) {
+			next = std::min(next, in_new_span ? new_span->end : new_span->start);
+		}
+		if (old_style != new_style) {
+			if (!changes.empty() && changes.back().end == pos) {
+				changes.back().end = next;
+			}
+			else {
+				changes.emplace_back(pos, next);
+			}
+		}
+		pos = next;
+	}
+}
+
+std::vector<Range> prism::update(const Language* language, const Input* input, Cache& cache, const Edit& edit, std::size_t window_start, std::size_t window_end, std::vector<Span>& spans) {
+	const Range window(edit.map(window_start), edit.map(window_end));
+	// the old spans at their new positions, without the removed bytes
+	std::vector<Span> old_spans;
+	for (const Span& span: spans) {
+		if (span.start < edit.pos) {
+			old_spans.emplace_back(span.start, std::min(span.end, edit.pos), span.style);
+		}
+		if (span.end > edit.pos + edit.removed) {
+			old_spans.emplace_back(edit.map(std::max(span.start, edit.pos + edit.removed)), edit.map(span.end), span.style);
+		}
+	}
+	// the snapshots share their blocks with the cache until it modifies them
+	const Cache::Node old_root = *cache.get_root_node();
+	const Structure old_structure = cache.get_structure();
+	cache.invalidate(edit.pos);
+	const std::size_t valid_end = cache.get_valid_end();
+	std::vector<Span> new_spans;
+	ParseContext context(input, new_spans, window.start, window.end);
+	context.set_old_cache(&old_root, &old_structure, &edit);
+	context.add_root_scope(cache, [&]() {
+		language->parse(context);
+	});
+	const std::size_t end = context.is_converged() ? std::min(context.get_position(), window.end) : window.end;
+	context.change_style(Style::DEFAULT);
+	context.commit();
+	// after the point of convergence the old spans are still valid
+	append_spans(new_spans, old_spans, Range(std::max(end, window.start), window.end));
+	std::vector<Range> changes;
+	const Range inserted = Range(edit.pos, edit.pos + edit.inserted) & window;
+	append_style_changes(changes, old_spans, new_spans, Range(std::max(window.start, valid_end), std::min(end, inserted.start)));
+	if (inserted) {
+		if (!changes.empty() && changes.back().end == inserted.start) {
+			changes.back().end = inserted.end;
+		}
+		else {
+			changes.push_back(inserted);
+		}
+	}
+	append_style_changes(changes, old_spans, new_spans, Range(std::max({window.start, valid_end, inserted.end}), end));
+	spans = std::move(new_spans);
+	return changes;
+}
+
+std::vector<Span> prism::highlight_appended(const Language* language, const Input* input, Cache& cache, std::size_t old_size, std::size_t window_start, std::size_t window_end) {
+	// checkpoints whose parse examined the end of the input are dropped, the others stay valid
+	cache.invalidate(old_size);
+	return highlight(language, input, cache, std::min(window_start, cache.get_valid_end()), window_end);
+}
+
+void prism::highlight_stream(const Language* language, const Input* input, StreamOutput& output) {
+	std::vector<Span> spans;
+	// stays empty, it only provides the root scope
+	Cache cache;
+	ParseContext context(input, spans, 0, SIZE_MAX);
+	context.set_stream_output(&output);
+	context.add_root_scope(cache, [&]() {
+		language->parse(context);
+	});
+	context.change_style(Style::DEFAULT);
+	context.commit();
+	output.write(spans, context.get_position());
+}
+
+HighlightTask::HighlightTask(const Language* language, const Input* input, Cache& cache, std::size_t window_start, std::size_t window_end, std::size_t max_lookahead): language(language), input(input), cache(&cache), pos(0), window_start(window_start), window_end(window_end), max_lookahead(max_lookahead), finished(false) {}
+
+bool HighlightTask::run(const Budget& budget) {
+	if (finished) {
+		return true;
+	}
+	std::vector<Span> new_spans;
+	ParseContext context(input, new_spans, window_start, window_end, max_lookahead);
+	context.set_budget(&budget, pos);
+	context.add_root_scope(*cache, [&]() {
+		language->parse(context);
+	});
+	const std::size_t stop_pos = context.get_position();
+	context.change_style(Style::DEFAULT);
+	context.commit();
+	auto first = new_spans.begin();
+	if (first != new_spans.end() && !spans.empty() && spans.back().end == first->start && spans.back().style == first->style) {
+		spans.back().end = first->end;
+		++first;
+	}
+	spans.insert(spans.end(), first, new_spans.end());
+	if (context.is_stopped()) {
+		pos = stop_pos;
+		window_start = std::max(window_start, stop_pos);
+	}
+	else {
+		finished = true;
+	}
+	return finished;
+}
+
+// calls f with the position and the bytes of each part of the range
+template <class F> static void for_each_chunk(const Input* input, std::size_t start, std::size_t end, F f) {
+	auto [chunk, offset] = input->get_chunk(start);
+	while (chunk.size > 0 && offset < end) {
+		const std::size_t first = std::max(start, offset) - offset;
+		const std::size_t last = std::min(end - offset, chunk.size);
+		if (first < last) {
+			f(offset + first, chunk.data + first, chunk.data + last);
+		}
+		offset += chunk.size;
+		chunk = input->get_next_chunk(chunk.chunk);
+	}
+}
+
+LineIndex::LineIndex(const Input* input, std::size_t size): line_starts{0} {
+	add_lines(input, 0, size);
+}
+void LineIndex::add_lines(const Input* input, std::size_t start, std::size_t end) {
+	std::vector<std::size_t> new_line_starts;
+	for_each_chunk(input, start, end, [&](std::size_t pos, const char* first, const char* last) {
+		for (const char* c = first; (c = static_cast<const char*>(std::memchr(c, '\n', last - c))); ++c) {
+			new_line_starts.push_back(pos + (c - first) + 1);
+		}
+	});
+	auto iter = std::upper_bound(line_starts.begin(), line_starts.end(), start);
+	line_starts.insert(iter, new_line_starts.begin(), new_line_starts.end());
+}
+void LineIndex::edit(const Input* input, const Edit& edit) {
+	// the lines whose newline was removed
+	auto first = std::upper_bound(line_starts.begin(), line_starts.end(), edit.pos);
+	auto last = std::upper_bound(first, line_starts.end(), edit.pos + edit.removed);
+	for (auto iter = last; iter != line_starts.end(); ++iter) {
+		*iter = *iter - edit.removed + edit.inserted;
+	}
+	line_starts.erase(first, last);
+	add_lines(input, edit.pos, edit.pos + edit.inserted);
+}
+std::size_t LineIndex::get_line_count() const {
+	return line_starts.size();
+}
+std::size_t LineIndex::get_line(std::size_t pos) const {
+	return std::upper_bound(line_starts.begin(), line_starts.end(), pos) - line_starts.begin() - 1;
+}
+std::size_t LineIndex::get_line_start(std::size_t line) const {
+	return line_starts[line];
+}
+std::size_t LineIndex::get_line_end(std::size_t line) const {
+	return line + 1 < line_starts.size() ? line_starts[line + 1] - 1 : SIZE_MAX;
+}
+
+// the number of code units in the range
+static std::size_t count_units(const Input* input, std::size_t start, std::size_t end, ColumnEncoding encoding) {
+	if (encoding == ColumnEncoding::UTF8) {
+		return end - start;
+	}
+	std::size_t units = 0;
+	for_each_chunk(input, start, end, [&](std::size_t pos, const char* first, const char* last) {
+		for (const char* c = first; c != last; ++c) {
+			const unsigned char byte = *c;
+			// continuation bytes do not count, 4-byte sequences are surrogate pairs in UTF-16
+			if ((byte & 0xC0) != 0x80) {
+				units += encoding == ColumnEncoding::UTF16 && byte >= 0xF0 ? 2 : 1;
+			}
+		}
+	});
+	return units;
+}
+
+// the end of the line without its newline, the '\r' of a "\r\n" belongs to the newline
+static std::size_t get_line_end(const Input* input, const LineIndex& lines, std::size_t line) {
+	const std::size_t end = lines.get_line_end(line);
+	bool carriage_return = false;
+	if (end != SIZE_MAX && end > lines.get_line_start(line)) {
+		for_each_chunk(input, end - 1, end, [&](std::size_t pos, const char* first, const char* last) {
+			carriage_return = *first == '\r';
+		});
+	}
+	return carriage_return ? end - 1 : end;
+}
+
+std::vector<const char*> prism::get_semantic_token_types() {
+	return {"comment", "keyword", "operator", "type", "number", "string", "escape", "function"};
+}
+
+std::vector<std::uint32_t> prism::get_semantic_tokens(const Input* input, const LineIndex& lines, const std::vector<Span>& spans, ColumnEncoding encoding) {
+	std::vector<std::uint32_t> tokens;
+	std::size_t last_line = 0;
+	std::size_t last_column = 0;
+	// the column of pos, which is on the line of the last token
+	std::size_t pos = 0;
+	std::size_t column = 0;
+	for (const Span& span: spans) {
+		if (span.style < Style::COMMENT) {
+			continue;
+		}
+		for (std::size_t line = lines.get_line(span.start); line < lines.get_line_count() && lines.get_line_start(line) < span.end; ++line) {
+			const std::size_t start = std::max(span.start, lines.get_line_start(line));
+			// only spans that reach the newline can include a '\r'
+			const std::size_t end = span.end < lines.get_line_end(line) ? span.end : get_line_end(input, lines, line);
+			if (start >= end) {
+				continue;
+			}
+			if (line != last_line || tokens.empty()) {
+				pos = lines.get_line_start(line);
+				column = 0;
+			}
+			column += count_units(input, pos, start, encoding);
+			const std::size_t length = count_units(input, start, end, encoding);
+			tokens.push_back(line - last_line);
+			tokens.push_back(line == last_line ? column - last_column : column);
+			tokens.push_back(length);
+			tokens.push_back(span.style - Style::COMMENT);
+			tokens.push_back(0);
+			last_line = line;
+			last_column = column;
+			pos = end;
+			column += length;
+		}
+	}
+	return tokens;
+}
+
+SemanticTokensEdit prism::get_semantic_tokens_edit(const std::vector<std::uint32_t>& old_tokens, const std::vector<std::uint32_t>& new_tokens) {
+	const std::size_t size = std::min(old_tokens.size(), new_tokens.size());
+	std::size_t prefix = std::mismatch(old_tokens.begin(), old_tokens.begin() + size, new_tokens.begin()).first - old_tokens.begin();
+	std::size_t suffix = std::mismatch(old_tokens.rbegin(), old_tokens.rbegin() + (size - prefix), new_tokens.rbegin()).first - old_tokens.rbegin();
+	// whole tokens only
+	prefix -= prefix % 5;
+	suffix -= suffix % 5;
+	return {prefix, old_tokens.size() - prefix - suffix, std::vector<std::uint32_t>(new_tokens.begin() + prefix, new_tokens.end() - suffix)};
+}
@@ -1,10 +1,17 @@
 #pragma once
 
+#include <cassert>
 #include <cstddef>
+#include <cstdint>
 #include <utility>
 #include <algorithm>
 #include <vector>
+#include <memory>
 #include <string>
+#include <tuple>
+#include <array>
+#include <chrono>
+#include <atomic>
 
 class Color {
 	static constexpr float hue_function(float h) {
@@ -94,6 +101,22 @@ public:
 	}
 };
 
+// the bytes [pos, pos + removed) were replaced with inserted bytes
+class Edit {
+public:
+	std::size_t pos;
+	std::size_t removed;
+	std::size_t inserted;
+	constexpr Edit(std::size_t pos, std::size_t removed, std::size_t inserted): pos(pos), removed(removed), inserted(inserted) {}
+	// the position after the edit of a position before the edit, removed positions move to the end of the inserted bytes
+	constexpr std::size_t map(std::size_t old_pos) const {
+		if (old_pos <= pos || old_pos == SIZE_MAX) {
+			return old_pos;
+		}
+		return std::max(old_pos, pos + removed) - removed + inserted;
+	}
+};
+
 class Span: public Range {
 public:
 	int style;
@@ -119,6 +142,8 @@ public:
 	virtual ~Input() = default;
 	virtual std::pair<Chunk, std::size_t> get_chunk(std::size_t pos) const = 0;
 	virtual Chunk get_next_chunk(const void* chunk) const = 0;
+	// a hint that the range is about to be read, given when the parse resumes from a checkpoint
+	virtual void prefetch(std::size_t start, std::size_t end) const {}
 };
 
 class StringInput final: public Input {
@@ -138,39 +163,385 @@ public:
 	}
 };
 
+// a vector whose blocks, including the last one, are shared between copies, copying it only copies the block pointers
+// and modifying it copies at most one block
+// blocks count as unshared when their reference count is one, which is not synchronised, so copies must not be used from different threads at the same time
+template <class T, std::size_t BLOCK_SIZE> class SharedVector {
+	using Block = std::vector<T>;
+	// null instead of empty
+	std::unique_ptr<std::vector<std::shared_ptr<Block>>> blocks;
+	// the block that is not full yet, null instead of empty
+	std::shared_ptr<Block> tail;
+	std::size_t get_block_count() const {
+		return blocks ? blocks->size() : 0;
+	}
+	std::size_t get_tail_size() const {
+		return tail ? tail->size() : 0;
+	}
+	// copies the block if it is shared with another vector
+	static Block& get_mutable_block(std::shared_ptr<Block>& block) {
+		if (block.use_count() != 1) {
+			block = std::make_shared<Block>(*block);
+		}
+		return *block;
+	}
+public:
+	SharedVector() {}
+	SharedVector(const SharedVector& vector): blocks(vector.blocks ? std::make_unique<std::vector<std::shared_ptr<Block>>>(*vector.blocks) : nullptr), tail(vector.tail) {}
+	SharedVector(SharedVector&&) = default;
+	SharedVector& operator =(const SharedVector& vector) {
+		return *this = SharedVector(vector);
+	}
+	SharedVector& operator =(SharedVector&&) = default;
+	std::size_t size() const {
+		return get_block_count() * BLOCK_SIZE + get_tail_size();
+	}
+	bool empty() const {
+		return !tail && !blocks;
+	}
+	const T& operator [](std::size_t i) const {
+		if (i / BLOCK_SIZE < get_block_count()) {
+			return (*(*blocks)[i / BLOCK_SIZE])[i % BLOCK_SIZE];
+		}
+		return (*tail)[i - get_block_count() * BLOCK_SIZE];
+	}
+	const T& back() const {
+		return tail ? tail->back() : blocks->back()->back();
+	}
+	// copies the block containing the element if it is shared with another vector
+	T& get_mutable(std::size_t i) {
+		if (i / BLOCK_SIZE < get_block_count()) {
+			return get_mutable_block((*blocks)[i / BLOCK_SIZE])[i % BLOCK_SIZE];
+		}
+		return get_mutable_block(tail)[i - get_block_count() * BLOCK_SIZE];
+	}
+	// grows by a quarter instead of doubling, the cache is long-lived and mostly appended to
+	template <class... A> T& emplace_back(A&&... arguments) {
+		if (get_tail_size() == BLOCK_SIZE) {
+			if (!blocks) {
+				blocks = std::make_unique<std::vector<std::shared_ptr<Block>>>();
+			}
+			blocks->push_back(std::move(tail));
+			tail = nullptr;
+		}
+		if (!tail) {
+			tail = std::make_shared<Block>();
+		}
+		Block& block = get_mutable_block(tail);
+		if (block.size() == block.capacity()) {
+			block.reserve(std::min(block.size() + block.size() / 4 + 1, BLOCK_SIZE));
+		}
+		block.emplace_back(std::forward<A>(arguments)...);
+		return block.back();
+	}
+	void truncate(std::size_t size) {
+		const std::size_t block_count = get_block_count();
+		if (size >= block_count * BLOCK_SIZE) {
+			const std::size_t tail_size = size - block_count * BLOCK_SIZE;
+			if (tail_size == 0) {
+				tail = nullptr;
+			}
+			else if (tail_size < get_tail_size()) {
+				if (tail.use_count() != 1) {
+					tail = std::make_shared<Block>(tail->begin(), tail->begin() + tail_size);
+				}
+				else {
+					tail->erase(tail->begin() + tail_size, tail->end());
+				}
+			}
+		}
+		else {
+			const Block& block = *(*blocks)[size / BLOCK_SIZE];
+			tail = size % BLOCK_SIZE > 0 ? std::make_shared<Block>(block.begin(), block.begin() + size % BLOCK_SIZE) : nullptr;
+			blocks->erase(blocks->begin() + size / BLOCK_SIZE, blocks->end());
+			if (blocks->empty()) {
+				blocks.reset();
+			}
+		}
+	}
+	// returns the index of the first element for which predicate is false
+	template <class P> std::size_t partition_point(P predicate) const {
+		if (blocks) {
+			auto block = std::partition_point(blocks->begin(), blocks->end(), [&](const std::shared_ptr<Block>& block) {
+				return predicate(block->back());
+			});
+			if (block != blocks->end()) {
+				return (block - blocks->begin()) * BLOCK_SIZE + (std::partition_point((*block)->begin(), (*block)->end(), predicate) - (*block)->begin());
+			}
+		}
+		return get_block_count() * BLOCK_SIZE + (tail ? std::partition_point(tail->begin(), tail->end(), predicate) - tail->begin() : 0);
+	}
+	std::size_t get_memory_usage() const {
+		std::size_t memory_usage = tail ? sizeof(Block) + tail->capacity() * sizeof(T) : 0;
+		if (blocks) {
+			memory_usage += blocks->capacity() * sizeof(std::shared_ptr<Block>) + blocks->size() * (sizeof(Block) + BLOCK_SIZE * sizeof(T));
+		}
+		return memory_usage;
+	}
+};
+
+// the delimiters found by the parse outside of strings and comments, with the matching delimiter of each
+class Structure {
+public:
+	struct Delimiter {
+		std::size_t start;
+		std::uint32_t length;
+		// index of the matching delimiter or NONE
+		std::uint32_t partner;
+		// index of the innermost unmatched opening delimiter before this one or NONE
+		std::uint32_t parent;
+		char kind;
+		bool open;
+		std::size_t get_end() const {
+			return start + length;
+		}
+	};
+	static constexpr std::uint32_t NONE = UINT32_MAX;
+private:
+	SharedVector<Delimiter, 512> delimiters;
+	std::size_t frontier;
+	bool enabled;
+	std::uint32_t get_innermost_open(std::size_t size) const;
+	void add(Delimiter delimiter);
+public:
+	Structure(bool enabled = false);
+	bool is_enabled() const;
+	// the index is complete up to the frontier
+	std::size_t get_frontier() const;
+	std::size_t size() const;
+	const Delimiter& operator [](std::size_t i) const;
+	// returns the index of the delimiter at pos or NONE
+	std::uint32_t find(std::size_t pos) const;
+	// returns the index of the innermost opening delimiter whose region contains pos or NONE
+	std::uint32_t find_enclosing(std::size_t pos) const;
+	// returns the regions from opening to matching closing delimiter that overlap the range, outermost first
+	std::vector<Range> get_regions(std::size_t start, std::size_t end) const;
+	void append(const std::vector<Delimiter>& new_delimiters, std::size_t pos);
+	// appends the delimiters of old_structure from old_pos on, moved to continue from pos
+	void graft(const Structure& old_structure, std::size_t old_pos, std::size_t pos);
+	void invalidate(std::size_t pos);
+	std::size_t get_memory_usage() const;
+};
+
 class Cache {
 public:
-	struct Checkpoint {
-		std::size_t pos;
-		std::size_t max_pos;
+	// a position and one past the furthest byte the parse had looked at when it got there, packed into 64 bits
+	class Checkpoint {
+		std::uint64_t bits;
+	public:
+		static constexpr std::size_t MAX_POS = (std::uint64_t(1) << 40) - 1;
+		static constexpr std::size_t MAX_LOOKAHEAD = (std::uint64_t(1) << 24) - 1;
+		// positions above MAX_POS are never cached, they would spill into the lookahead
+		constexpr Checkpoint(std::size_t pos, std::size_t max_pos): bits((pos & MAX_POS) | std::min<std::uint64_t>(max_pos - pos, MAX_LOOKAHEAD) << 40) {
+			assert(pos <= MAX_POS);
+		}
+		constexpr std::size_t get_pos() const {
+			return bits & MAX_POS;
+		}
+		constexpr std::size_t get_max_pos() const {
+			const std::size_t lookahead = bits >> 40;
+			return lookahead == MAX_LOOKAHEAD ? SIZE_MAX : get_pos() + lookahead;
+		}
+		// whether the position is still at most MAX_POS when moved from after old_pos by pos - old_pos, pos is at most MAX_POS
+		constexpr bool can_move(std::size_t old_pos, std::size_t pos) const {
+			return get_pos() - old_pos <= MAX_POS - pos;
+		}
+		// moved by pos - old_pos, with a max_pos of at least min_max_pos
+		constexpr Checkpoint moved(std::size_t old_pos, std::size_t pos, std::size_t min_max_pos) const {
+			return Checkpoint(get_pos() - old_pos + pos, std::max(get_max_pos() == SIZE_MAX ? SIZE_MAX : get_max_pos() - old_pos + pos, min_max_pos));
+		}
+	};
+	struct Statistics {
+		std::size_t nodes;
+		std::size_t checkpoints;
+		std::size_t memory_usage;
+		std::size_t depth;
+		// the furthest position the cache has a checkpoint for
+		std::size_t frontier;
+		std::size_t highlight_calls;
+		// how far before window_start the last highlight call had to start parsing
+		std::size_t last_rescan_distance;
+		// rescan_distances[i] counts the highlight calls whose rescan distance needs i bits
+		std::array<std::size_t, 65> rescan_distances;
 	};
 	struct Node {
 		const void* expression;
-		std::size_t start_pos;
-		std::size_t start_max_pos;
-		std::vector<Checkpoint> checkpoints;
-		std::vector<Node> children;
+		Checkpoint start;
+		SharedVector<Checkpoint, 512> checkpoints;
+		SharedVector<Node, 64> children;
 		Node(const void* expression, std::size_t start_pos, std::size_t start_max_pos);
 		std::size_t get_last_checkpoint() const;
 		void add_checkpoint(std::size_t pos, std::size_t max_pos);
 		const Checkpoint* find_checkpoint(std::size_t pos) const;
-		Node* find_child(const void* expression, std::size_t pos);
+		std::size_t find_child_index(const void* expression, std::size_t pos) const;
+		const Node* find_child(const void* expression, std::size_t pos) const;
+		// copies the block containing the child if it is shared with a snapshot
+		Node* find_mutable_child(const void* expression, std::size_t pos);
 		Node* add_child(const void* expression, std::size_t pos, std::size_t max_pos);
+		// a copy with all checkpoints moved, see Checkpoint::moved
+		Node moved(std::size_t old_pos, std::size_t pos, std::size_t min_max_pos) const;
+		// appends the checkpoints and children of old_node after old_pos, moved to continue from pos
+		// min_max_pos keeps the max_pos of the checkpoints in order with the ones before pos
+		void graft(const Node& old_node, std::size_t old_pos, std::size_t pos, std::size_t min_max_pos);
 		void invalidate(std::size_t pos);
+		std::size_t get_memory_usage() const;
+		void collect_statistics(Statistics& statistics, std::size_t depth) const;
+	};
+	// the spans of a range that was highlighted with unlimited lookahead
+	struct SpanRun {
+		Range range;
+		std::vector<Span> spans;
 	};
 private:
-	Node root_node;
+	std::shared_ptr<Node> root_node;
+	Structure structure;
+	// sorted and not overlapping
+	std::vector<SpanRun> span_runs;
+	std::size_t span_cache_size;
+	std::size_t max_depth;
+	std::size_t highlight_calls;
+	std::size_t last_rescan_distance;
+	std::array<std::size_t, 65> rescan_distances;
+	void clip_span_runs(const Range& range);
 public:
-	Cache();
+	// references nested deeper than max_depth fail to match instead of growing the stack
+	// at the default the deepest grammar, nested JavaScript template literals, uses about 180 KiB of stack optimised and 450 KiB unoptimised
+	// the spans of up to span_cache_size bytes around the recently highlighted windows are kept for reuse
+	explicit Cache(std::size_t max_depth = 256, bool record_structure = false, std::size_t span_cache_size = 0);
+	// copying a cache takes a snapshot that shares all nodes until either copy is modified
+	// a cache and its snapshots must be used from one thread at a time, the sharing is not synchronised
+	Cache(const Cache&);
+	Cache(Cache&&);
+	Cache& operator =(const Cache&);
+	Cache& operator =(Cache&&);
 	~Cache();
-	Node* get_root_node();
+	const Node* get_root_node() const;
+	// copies the root node if it is shared with a snapshot
+	Node* get_mutable_root_node();
+	std::size_t get_max_depth() const;
+	// the furthest checkpoint, everything the parse committed before it is still valid
+	std::size_t get_valid_end() const;
+	const Structure& get_structure() const;
+	Structure& get_structure();
+	std::size_t get_span_cache_size() const;
+	// returns the first span run that ends after pos or nullptr
+	const SpanRun* find_span_run(std::size_t pos) const;
+	// the range must not overlap any existing run
+	void add_span_run(const Range& range, const std::vector<Span>& spans);
+	// drops the spans furthest from the window until the runs fit into the span cache size
+	void trim_span_runs(const Range& window);
 	void invalidate(std::size_t pos);
+	std::size_t get_memory_usage() const;
+	void add_rescan_distance(std::size_t distance);
+	Statistics get_statistics() const;
+};
+
+// receives the spans of an input that is highlighted in a single pass
+class StreamOutput {
+public:
+	virtual ~StreamOutput() = default;
+	// the spans end before pos and the parse does not look at the input before pos again
+	virtual void write(const std::vector<Span>& spans, std::size_t pos) = 0;
+};
+
+// limits the work done by a single highlight call
+class Budget {
+	std::chrono::steady_clock::time_point deadline;
+	std::size_t max_steps;
+	const std::atomic<bool>* cancelled;
+public:
+	Budget(std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max(), std::size_t max_steps = SIZE_MAX, const std::atomic<bool>* cancelled = nullptr): deadline(deadline), max_steps(max_steps), cancelled(cancelled) {}
+	Budget(std::chrono::steady_clock::duration timeout): Budget(std::chrono::steady_clock::now() + timeout) {}
+	bool is_exhausted(std::size_t steps, bool check_clock) const {
+		if (steps >= max_steps) {
+			return true;
+		}
+		if (check_clock) {
+			return (cancelled && cancelled->load(std::memory_order_relaxed)) || std::chrono::steady_clock::now() >= deadline;
+		}
+		return false;
+	}
+};
+
+// the start of every line, kept up to date with edits
+class LineIndex {
+	std::vector<std::size_t> line_starts;
+	void add_lines(const Input* input, std::size_t start, std::size_t end);
+public:
+	LineIndex(const Input* input, std::size_t size);
+	// input is the text after the edit
+	void edit(const Input* input, const Edit& edit);
+	std::size_t get_line_count() const;
+	std::size_t get_line(std::size_t pos) const;
+	std::size_t get_line_start(std::size_t line) const;
+	// the end of the line without its newline, for the last line this is SIZE_MAX
+	std::size_t get_line_end(std::size_t line) const;
+};
+
+// how columns and lengths of semantic tokens are counted
+enum class ColumnEncoding {
+	UTF8,
+	UTF16,
+	UTF32
+};
+
+// a single edit of the semantic tokens array, as in semanticTokens/full/delta
+struct SemanticTokensEdit {
+	std::size_t start;
+	std::size_t delete_count;
+	std::vector<std::uint32_t> data;
+};
+
+// highlights a window over one or more calls to run, each limited by a budget
+class HighlightTask {
+	const Language* language;
+	const Input* input;
+	Cache* cache;
+	std::size_t pos;
+	std::size_t window_start;
+	std::size_t window_end;
+	std::size_t max_lookahead;
+	std::vector<Span> spans;
+	bool finished;
+public:
+	HighlightTask(const Language* language, const Input* input, Cache& cache, std::size_t window_start, std::size_t window_end, std::size_t max_lookahead = SIZE_MAX);
+	bool run(const Budget& budget);
+	bool is_finished() const {
+		return finished;
+	}
+	std::size_t get_position() const {
+		return pos;
+	}
+	const std::vector<Span>& get_spans() const {
+		return spans;
+	}
+	std::vector<Span> take_spans() {
+		return std::move(spans);
+	}
 };
 
 namespace prism {
 
 const Theme& get_theme(const char* name);
 const Language* get_language(const char* file_name);
-std::vector<Span> highlight(const Language* language, const Input* input, Cache& cache, std::size_t window_start, std::size_t window_end);
+std::vector<Span> highlight(const Language* language, const Input* input, Cache& cache, std::size_t window_start, std::size_t window_end, std::size_t max_lookahead = SIZE_MAX);
+// windows must be sorted by start, windows that overlap or are close together share a single parse
+std::vector<std::vector<Span>> highlight(const Language* language, const Input* input, Cache& cache, const std::vector<Range>& windows, std::size_t max_lookahead = SIZE_MAX);
+// invalidates the cache for the edit and re-highlights the window, which moves with the text
+// spans must hold the spans of the window before the edit and is replaced by the spans after it
+// returns the ranges whose style changed and the inserted bytes, parsing stops where it converges with the parse before the edit
+std::vector<Range> update(const Language* language, const Input* input, Cache& cache, const Edit& edit, std::size_t window_start, std::size_t window_end, std::vector<Span>& spans);
+// highlights the window after bytes were appended to an input of old_size bytes, only the parse state that looked at the old end is discarded
+// the spans start at window_start or at the first byte whose style may have changed, whichever comes first
+std::vector<Span> highlight_appended(const Language* language, const Input* input, Cache& cache, std::size_t old_size, std::size_t window_start, std::size_t window_end);
+// highlights an input from start to end in a single pass without keeping checkpoints, such as a pipe that cannot be read twice
+// the spans are written to output in steps as they become final, after each step the input can release the bytes before pos
+void highlight_stream(const Language* language, const Input* input, StreamOutput& output);
+// the legend of the semantic tokens, the token type of a style is style - Style::COMMENT
+std::vector<const char*> get_semantic_token_types();
+// delta-encoded (line, column, length, token type, modifiers) tuples as in LSP semantic tokens, spans are split at line ends
+std::vector<std::uint32_t> get_semantic_tokens(const Input* input, const LineIndex& lines, const std::vector<Span>& spans, ColumnEncoding encoding = ColumnEncoding::UTF16);
+// the edit that turns old_tokens into new_tokens, empty if they are equal
+SemanticTokensEdit get_semantic_tokens_edit(const std::vector<std::uint32_t>& old_tokens, const std::vector<std::uint32_t>& new_tokens);
 
 }
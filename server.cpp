@@ -0,0 +1,524 @@
+#include "workspace.hpp"
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <algorithm>
+#include <string>
+#include <deque>
+#include <set>
+#include <iostream>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <signal.h>
+
+// The protocol is a stream of frames in both directions, integers are little-endian.
+// A request is a u32 size, a u32 id, a u8 type and size - 5 bytes of payload:
+//   OPEN       u32 name size, name, content                -> u64 document
+//   EDIT       u64 document, u64 pos, u64 removed, inserted
+//   HIGHLIGHT  u64 document, u64 window start, u64 window end -> u32 count, count times u64 start, u64 end, u8 style
+//   CLOSE      u64 document
+// A response is a u32 size, the u32 id of the request, a u8 status and size - 5 bytes of payload.
+// Requests may be pipelined, the responses come in the order of the requests.
+// Documents belong to the client that opened them, requests for the documents of other clients fail.
+// Closed documents stay resident, opening the same name again reuses one of them and edits it from
+// the first difference on. Documents are closed when their client disconnects.
+
+enum Request: std::uint8_t {
+	OPEN = 1,
+	EDIT = 2,
+	HIGHLIGHT = 3,
+	CLOSE = 4
+};
+enum Status: std::uint8_t {
+	OK = 0,
+	ERROR = 1
+};
+// larger documents are opened in parts, with EDIT requests that append to them
+constexpr std::size_t MAX_FRAME_SIZE = std::size_t(1) << 26;
+
+class SharedInput final: public Input {
+	std::shared_ptr<const std::string> text;
+public:
+	SharedInput(std::shared_ptr<const std::string> text): text(std::move(text)) {}
+	std::pair<Chunk, std::size_t> get_chunk(std::size_t pos) const override {
+		return {{nullptr, text->data(), text->size()}, 0};
+	}
+	Chunk get_next_chunk(const void* chunk) const override {
+		return {nullptr, "", 0};
+	}
+};
+
+class Server {
+	struct DocumentState {
+		Workspace::Document document;
+		std::string name;
+		// edits of a document are applied one at a time
+		std::mutex mutex;
+		std::shared_ptr<const std::string> text;
+		// whether a client has the document open
+		bool open;
+		std::uint64_t last_used;
+	};
+	Workspace workspace;
+	std::size_t max_idle_documents;
+	std::mutex mutex;
+	std::map<Workspace::Document, std::shared_ptr<DocumentState>> documents;
+	std::multimap<std::string, std::shared_ptr<DocumentState>> names;
+	std::uint64_t clock;
+	std::shared_ptr<DocumentState> get_document(Workspace::Document document) {
+		std::lock_guard<std::mutex> lock(mutex);
+		auto iter = documents.find(document);
+		if (iter == documents.end()) {
+			return nullptr;
+		}
+		iter->second->last_used = ++clock;
+		return iter->second;
+	}
+	void replace_text(DocumentState& state, std::shared_ptr<const std::string> text, std::size_t pos) {
+		state.text = text;
+		workspace.edit(state.document, std::make_unique<SharedInput>(text), text->size(), pos);
+	}
+	// removes the least recently used documents that no client has open, they have to be closed in the workspace
+	// after unlocking the mutex because closing waits for their highlights
+	std::vector<Workspace::Document> remove_idle_documents() {
+		std::vector<Workspace::Document> removed;
+		std::vector<std::pair<std::uint64_t, DocumentState*>> idle;
+		for (auto& document: documents) {
+			if (!document.second->open) {
+				idle.emplace_back(document.second->last_used, document.second.get());
+			}
+		}
+		if (idle.size() <= max_idle_documents) {
+			return removed;
+		}
+		std::sort(idle.begin(), idle.end());
+		for (std::size_t i = 0; i < idle.size() - max_idle_documents; ++i) {
+			removed.push_back(idle[i].second->document);
+			auto range = names.equal_range(idle[i].second->name);
+			for (auto iter = range.first; iter != range.second; ++iter) {
+				if (iter->second.get() == idle[i].second) {
+					names.erase(iter);
+					break;
+				}
+			}
+			documents.erase(idle[i].second->document);
+		}
+		return removed;
+	}
+public:
+	Server(std::size_t threads, std::size_t memory_limit, std::size_t max_idle_documents): workspace(threads, memory_limit), max_idle_documents(max_idle_documents), clock(0) {}
+	bool open(const std::string& name, std::string content, Workspace::Document& document) {
+		const Language* language = prism::get_language(name.c_str());
+		if (language == nullptr) {
+			return false;
+		}
+		auto text = std::make_shared<const std::string>(std::move(content));
+		std::unique_lock<std::mutex> lock(mutex);
+		// a resident document of the same name that no client has open
+		auto range = names.equal_range(name);
+		auto iter = std::find_if(range.first, range.second, [](const auto& entry) {
+			return !entry.second->open;
+		});
+		if (iter == range.second) {
+			auto state = std::make_shared<DocumentState>();
+			state->document = workspace.open(language, std::make_unique<SharedInput>(text), text->size());
+			state->name = name;
+			state->text = text;
+			state->open = true;
+			state->last_used = ++clock;
+			documents[state->document] = state;
+			names.emplace(name, state);
+			document = state->document;
+			return true;
+		}
+		std::shared_ptr<DocumentState> state = iter->second;
+		state->open = true;
+		state->last_used = ++clock;
+		document = state->document;
+		lock.unlock();
+		std::lock_guard<std::mutex> document_lock(state->mutex);
+		if (*state->text != *text) {
+			const std::size_t pos = std::mismatch(text->begin(), text->begin() + std::min(text->size(), state->text->size()), state->text->begin()).first - text->begin();
+			replace_text(*state, text, pos);
+		}
+		return true;
+	}
+	bool edit(Workspace::Document document, std::size_t pos, std::size_t removed, const char* inserted, std::size_t inserted_size) {
+		std::shared_ptr<DocumentState> state = get_document(document);
+		if (state == nullptr) {
+			return false;
+		}
+		std::lock_guard<std::mutex> lock(state->mutex);
+		if (pos > state->text->size() || removed > state->text->size() - pos) {
+			return false;
+		}
+		auto text = std::make_shared<std::string>(*state->text);
+		text->replace(pos, removed, inserted, inserted_size);
+		replace_text(*state, std::move(text), pos);
+		return true;
+	}
+	bool highlight(Workspace::Document document, std::size_t window_start, std::size_t window_end, std::future<std::vector<Span>>& spans) {
+		if (get_document(document) == nullptr) {
+			return false;
+		}
+		spans = workspace.highlight(document, window_start, window_end);
+		return true;
+	}
+	bool close(Workspace::Document document) {
+		std::unique_lock<std::mutex> lock(mutex);
+		auto iter = documents.find(document);
+		if (iter == documents.end() || !iter->second->open) {
+			return false;
+		}
+		iter->second->open = false;
+		const std::vector<Workspace::Document> removed = remove_idle_documents();
+		lock.unlock();
+		for (Workspace::Document removed_document: removed) {
+			workspace.close(removed_document);
+		}
+		return true;
+	}
+};
+
+static bool read_all(int fd, char* data, std::size_t size) {
+	while (size > 0) {
+		const ssize_t n = read(fd, data, size);
+		if (n <= 0) {
+			return false;
+		}
+		data += n;
+		size -= n;
+	}
+	return true;
+}
+static bool write_all(int fd, const char* data, std::size_t size) {
+	while (size > 0) {
+		const ssize_t n = write(fd, data, size);
+		if (n <= 0) {
+			return false;
+		}
+		data += n;
+		size -= n;
+	}
+	return true;
+}
+
+class FrameReader {
+	const char* data;
+	const char* end;
+	bool valid;
+	std::uint64_t read(std::size_t size) {
+		if (static_cast<std::size_t>(end - data) < size) {
+			valid = false;
+			return 0;
+		}
+		std::uint64_t value = 0;
+		for (std::size_t i = 0; i < size; ++i) {
+			value |= std::uint64_t(static_cast<unsigned char>(data[i])) << (i * 8);
+		}
+		data += size;
+		return value;
+	}
+public:
+	FrameReader(const std::string& frame): data(frame.data()), end(frame.data() + frame.size()), valid(true) {}
+	bool is_valid() const {
+		return valid;
+	}
+	std::uint8_t read_u8() {
+		return read(1);
+	}
+	std::uint32_t read_u32() {
+		return read(4);
+	}
+	std::uint64_t read_u64() {
+		return read(8);
+	}
+	std::string read_bytes(std::size_t size) {
+		if (static_cast<std::size_t>(end - data) < size) {
+			valid = false;
+			return std::string();
+		}
+		std::string bytes(data, size);
+		data += size;
+		return bytes;
+	}
+	std::string read_rest() {
+		return read_bytes(end - data);
+	}
+};
+
+class FrameWriter {
+	std::string data;
+	void write(std::uint64_t value, std::size_t size) {
+		for (std::size_t i = 0; i < size; ++i) {
+			data.push_back(static_cast<char>(value >> (i * 8)));
+		}
+	}
+public:
+	FrameWriter(std::uint32_t id, Status status) {
+		write(0, 4);
+		write(id, 4);
+		write(status, 1);
+	}
+	void write_u8(std::uint8_t value) {
+		write(value, 1);
+	}
+	void write_u32(std::uint32_t value) {
+		write(value, 4);
+	}
+	void write_u64(std::uint64_t value) {
+		write(value, 8);
+	}
+	const std::string& finish() {
+		const std::uint32_t size = data.size() - 4;
+		for (std::size_t i = 0; i < 4; ++i) {
+			data[i] = static_cast<char>(size >> (i * 8));
+		}
+		return data;
+	}
+};
+
+// the responses of a connection in the order of the requests, written by their own thread so that requests can be pipelined
+class ResponseQueue {
+	struct Response {
+		std::uint32_t id;
+		Workspace::Document document;
+		Status status;
+		std::string payload;
+		// only for HIGHLIGHT
+		std::shared_future<std::vector<Span>> spans;
+	};
+	std::mutex mutex;
+	std::condition_variable condition;
+	std::deque<Response> responses;
+	bool finished;
+public:
+	ResponseQueue(): finished(false) {}
+	void push(std::uint32_t id, Status status, std::string payload = std::string()) {
+		std::lock_guard<std::mutex> lock(mutex);
+		responses.push_back({id, 0, status, std::move(payload), {}});
+		condition.notify_all();
+	}
+	void push_highlight(std::uint32_t id, Workspace::Document document, std::future<std::vector<Span>> spans) {
+		std::lock_guard<std::mutex> lock(mutex);
+		responses.push_back({id, document, OK, std::string(), spans.share()});
+		condition.notify_all();
+	}
+	// waits for the pending highlights of the document so that an edit does not overtake them
+	void wait_for_highlights(Workspace::Document document) {
+		std::vector<std::shared_future<std::vector<Span>>> pending;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			for (const Response& response: responses) {
+				if (response.spans.valid() && response.document == document) {
+					pending.push_back(response.spans);
+				}
+			}
+		}
+		for (const auto& spans: pending) {
+			spans.wait();
+		}
+	}
+	void finish() {
+		std::lock_guard<std::mutex> lock(mutex);
+		finished = true;
+		condition.notify_all();
+	}
+	void write_responses(int fd) {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			condition.wait(lock, [this]() {
+				return finished || !responses.empty();
+			});
+			if (responses.empty()) {
+				return;
+			}
+			Response response = responses.front();
+			lock.unlock();
+			FrameWriter frame(response.id, response.status);
+			if (response.spans.valid()) {
+				const std::vector<Span>& spans = response.spans.get();
+				frame.write_u32(spans.size());
+				for (const Span& span: spans) {
+					frame.write_u64(span.start);
+					frame.write_u64(span.end);
+					frame.write_u8(span.style);
+				}
+			}
+			else {
+				for (char c: response.payload) {
+					frame.write_u8(c);
+				}
+			}
+			// keep reading requests after the client went away so that the reader is not blocked
+			const std::string& data = frame.finish();
+			write_all(fd, data.data(), data.size());
+			lock.lock();
+			responses.pop_front();
+		}
+	}
+};
+
+static void serve(Server& server, int in, int out) {
+	ResponseQueue responses;
+	std::thread writer(&ResponseQueue::write_responses, &responses, out);
+	// the documents this client has open
+	std::set<Workspace::Document> documents;
+	char header[4];
+	while (read_all(in, header, sizeof(header))) {
+		std::uint32_t size = 0;
+		for (std::size_t i = 0; i < 4; ++i) {
+			size |= std::uint32_t(static_cast<unsigned char>(header[i])) << (i * 8);
+		}
+		if (size < 5 || size > MAX_FRAME_SIZE) {
+			break;
+		}
+		std::string frame(size, '\0');
+		if (!read_all(in, &frame[0], size)) {
+			break;
+		}
+		FrameReader reader(frame);
+		const std::uint32_t id = reader.read_u32();
+		const std::uint8_t type = reader.read_u8();
+		switch (type) {
+		case OPEN: {
+			const std::uint32_t name_size = reader.read_u32();
+			const std::string name = reader.read_bytes(name_size);
+			Workspace::Document document;
+			if (reader.is_valid() && server.open(name, reader.read_rest(), document)) {
+				documents.insert(document);
+				std::string payload;
+				for (std::size_t i = 0; i < 8; ++i) {
+					payload.push_back(static_cast<char>(std::uint64_t(document) >> (i * 8)));
+				}
+				responses.push(id, OK, std::move(payload));
+			}
+			else {
+				responses.push(id, ERROR);
+			}
+			break;
+		}
+		case EDIT: {
+			const Workspace::Document document = reader.read_u64();
+			const std::size_t pos = reader.read_u64();
+			const std::size_t removed = reader.read_u64();
+			const std::string inserted = reader.read_rest();
+			responses.wait_for_highlights(document);
+			const bool success = reader.is_valid() && documents.count(document) > 0 && server.edit(document, pos, removed, inserted.data(), inserted.size());
+			responses.push(id, success ? OK : ERROR);
+			break;
+		}
+		case HIGHLIGHT: {
+			const Workspace::Document document = reader.read_u64();
+			const std::size_t window_start = reader.read_u64();
+			const std::size_t window_end = reader.read_u64();
+			std::future<std::vector<Span>> spans;
+			if (reader.is_valid() && documents.count(document) > 0 && window_start <= window_end && server.highlight(document, window_start, window_end, spans)) {
+				responses.push_highlight(id, document, std::move(spans));
+			}
+			else {
+				responses.push(id, ERROR);
+			}
+			break;
+		}
+		case CLOSE: {
+			const Workspace::Document document = reader.read_u64();
+			responses.wait_for_highlights(document);
+			const bool success = reader.is_valid() && documents.erase(document) > 0 && server.close(document);
+			responses.push(id, success ? OK : ERROR);
+			break;
+		}
+		default:
+			responses.push(id, ERROR);
+			break;
+		}
+	}
+	responses.finish();
+	writer.join();
+	for (Workspace::Document document: documents) {
+		server.close(document);
+	}
+}
+
+static bool parse_size(const char* string, std::size_t& value) {
+	char* end;
+	errno = 0;
+	const unsigned long long result = std::strtoull(string, &end, 10);
+	if (end == string || *end != '\0' || errno == ERANGE || *string == '-') {
+		return false;
+	}
+	value = result;
+	return true;
+}
+
+static int listen_on(const char* path) {
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	if (std::strlen(path) >= sizeof(address.sun_path)) {
+		return -1;
+	}
+	std::strcpy(address.sun_path, path);
+	const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	unlink(path);
+	if (bind(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0 || listen(fd, 64) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int main(int argc, const char** argv) {
+	const char* socket_path = nullptr;
+	std::size_t threads = std::thread::hardware_concurrency();
+	std::size_t memory_limit = 0;
+	std::size_t max_idle_documents = 64;
+	for (int i = 1; i < argc; ++i) {
+		const std::string argument = argv[i];
+		if (argument == "--socket" && i + 1 < argc) {
+			socket_path = argv[++i];
+		}
+		else if (argument == "--threads" && i + 1 < argc && parse_size(argv[i + 1], threads)) {
+			++i;
+		}
+		else if (argument == "--memory-limit" && i + 1 < argc && parse_size(argv[i + 1], memory_limit)) {
+			++i;
+		}
+		else if (argument == "--max-idle-documents" && i + 1 < argc && parse_size(argv[i + 1], max_idle_documents)) {
+			++i;
+		}
+		else if (argument != "--stdio") {
+			std::cerr << "Usage: " << argv[0] << " [--stdio | --socket PATH] [--threads N] [--memory-limit BYTES] [--max-idle-documents N]\n";
+			return 1;
+		}
+	}
+	signal(SIGPIPE, SIG_IGN);
+	Server server(threads, memory_limit, max_idle_documents);
+	if (socket_path == nullptr) {
+		serve(server, STDIN_FILENO, STDOUT_FILENO);
+		return 0;
+	}
+	const int fd = listen_on(socket_path);
+	if (fd < 0) {
+		std::cerr << "cannot listen on " << socket_path << ": " << std::strerror(errno) << "\n";
+		return 1;
+	}
+	while (true) {
+		const int connection = accept(fd, nullptr, nullptr);
+		if (connection < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		std::thread([&server, connection]() {
+			serve(server, connection, connection);
+			close(connection);
+		}).detach();
+	}
+	close(fd);
+	return 1;
+}
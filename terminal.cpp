@@ -1,12 +1,32 @@
 #include <prism.hpp>
+#include <workspace.hpp>
 #include <vector>
+#include <deque>
 #include <cmath>
+#include <cstring>
 #include <fstream>
+#include <sstream>
 #include <iostream>
+// the pager, follow mode and pipes need POSIX, plain highlighting works everywhere
+#if defined(__unix__) || defined(__APPLE__)
+#define POSIX_TERMINAL
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#endif
 
 class FileInput final: public Input {
 	std::vector<char> data_;
 public:
+	FileInput() {}
 	template <class I> FileInput(I first, I last): data_(first, last) {}
 	char operator [](std::size_t i) const {
 		return data_[i];
@@ -17,6 +37,55 @@ public:
 	std::size_t size() const {
 		return data_.size();
 	}
+	void append(const char* data, std::size_t size) {
+		data_.insert(data_.end(), data, data + size);
+	}
+	void clear() {
+		data_.clear();
+	}
+	std::pair<Chunk, std::size_t> get_chunk(std::size_t pos) const override {
+		return {{nullptr, data(), size()}, 0};
+	}
+	Chunk get_next_chunk(const void* chunk) const override {
+		return {nullptr, "", 0};
+	}
+};
+
+#ifdef POSIX_TERMINAL
+// maps the file instead of reading it so that large files can be paged through right away
+class MappedInput final: public Input {
+	const char* data_;
+	std::size_t size_;
+public:
+	MappedInput(const char* path): data_(""), size_(0) {
+		const int fd = open(path, O_RDONLY);
+		struct stat status;
+		if (fd < 0 || fstat(fd, &status) < 0 || status.st_size == 0) {
+			if (fd >= 0) {
+				close(fd);
+			}
+			return;
+		}
+		void* data = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (data != MAP_FAILED) {
+			data_ = static_cast<const char*>(data);
+			size_ = status.st_size;
+		}
+	}
+	MappedInput(const MappedInput&) = delete;
+	MappedInput& operator =(const MappedInput&) = delete;
+	~MappedInput() {
+		if (size_ > 0) {
+			munmap(const_cast<char*>(data_), size_);
+		}
+	}
+	const char* data() const {
+		return data_;
+	}
+	std::size_t size() const {
+		return size_;
+	}
 	std::pair<Chunk, std::size_t> get_chunk(std::size_t pos) const override {
 		return {{nullptr, data(), size()}, 0};
 	}
@@ -25,19 +94,93 @@ public:
 	}
 };
 
+// reads a pipe in blocks as the parse gets to them and keeps only the blocks after the released position
+class StreamInput final: public Input {
+	static constexpr std::size_t BLOCK_SIZE = 1 << 16;
+	struct Block {
+		std::size_t offset;
+		std::vector<char> data;
+	};
+	int fd;
+	// references to the blocks stay valid when blocks are added at the back or removed from the front
+	mutable std::deque<Block> blocks;
+	mutable std::size_t size_;
+	mutable bool finished;
+	bool read_block() const {
+		while (!finished) {
+			std::vector<char> data(BLOCK_SIZE);
+			const ssize_t n = read(fd, data.data(), data.size());
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n <= 0) {
+				finished = true;
+				return false;
+			}
+			data.resize(n);
+			blocks.push_back({size_, std::move(data)});
+			size_ += n;
+			return true;
+		}
+		return false;
+	}
+	static Chunk get_chunk(const Block& block) {
+		return {&block, block.data.data(), block.data.size()};
+	}
+public:
+	StreamInput(int fd): fd(fd), size_(0), finished(false) {}
+	std::pair<Chunk, std::size_t> get_chunk(std::size_t pos) const override {
+		while (pos >= size_ && read_block()) {}
+		for (const Block& block: blocks) {
+			if (pos < block.offset + block.data.size()) {
+				return {get_chunk(block), block.offset};
+			}
+		}
+		return {{nullptr, "", 0}, pos};
+	}
+	Chunk get_next_chunk(const void* chunk) const override {
+		const Block* block = static_cast<const Block*>(chunk);
+		if (block == &blocks.back() && !read_block()) {
+			return {nullptr, "", 0};
+		}
+		for (auto iter = blocks.begin(); iter != blocks.end(); ++iter) {
+			if (&*iter == block) {
+				return get_chunk(*std::next(iter));
+			}
+		}
+		return {nullptr, "", 0};
+	}
+	// the bytes before pos are not read again
+	void release(std::size_t pos) {
+		while (!blocks.empty() && blocks.front().offset + blocks.front().data.size() <= pos && &blocks.front() != &blocks.back()) {
+			blocks.pop_front();
+		}
+	}
+	template <class F> void for_each_chunk(std::size_t start, std::size_t end, F f) const {
+		for (const Block& block: blocks) {
+			const std::size_t first = std::max(start, block.offset);
+			const std::size_t last = std::min(end, block.offset + block.data.size());
+			if (first < last) {
+				f(block.data.data() + (first - block.offset), last - first);
+			}
+		}
+	}
+};
+#endif
+
 static FileInput read_file(const char* path) {
 	std::ifstream file(path);
 	return FileInput(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
 }
 
-static void set_background_color(const Color& color) {
-	std::cout << "\e[48;2;"
+static void set_background_color(const Color& color, std::ostream& out = std::cout) {
+	out << "\e[48;2;"
 		<< std::round(color.r * 255) << ";"
 		<< std::round(color.g * 255) << ";"
 		<< std::round(color.b * 255) << "m";
 }
-static void apply_style(const Style& style) {
-	std::cout << "\e[38;2;"
+static void apply_style(const Style& style, std::ostream& out = std::cout) {
+	out << "\e[38;2;"
 		<< std::round(style.color.r * 255) << ";"
 		<< std::round(style.color.g * 255) << ";"
 		<< std::round(style.color.b * 255) << ";"
@@ -99,17 +242,660 @@ static void highlight_incremental(const char* path, const Language* language, co
 	std::cout << '\n';
 }
 
+#ifdef POSIX_TERMINAL
+// the length of the common prefix, memcmp compares whole blocks at a time
+static std::size_t get_common_prefix(const char* a, const char* b, std::size_t size) {
+	constexpr std::size_t BLOCK_SIZE = 4096;
+	std::size_t i = 0;
+	while (i + BLOCK_SIZE <= size && std::memcmp(a + i, b + i, BLOCK_SIZE) == 0) {
+		i += BLOCK_SIZE;
+	}
+	while (i < size && a[i] == b[i]) {
+		++i;
+	}
+	return i;
+}
+static std::size_t get_common_suffix(const char* a_end, const char* b_end, std::size_t size) {
+	constexpr std::size_t BLOCK_SIZE = 4096;
+	std::size_t i = 0;
+	while (i + BLOCK_SIZE <= size && std::memcmp(a_end - i - BLOCK_SIZE, b_end - i - BLOCK_SIZE, BLOCK_SIZE) == 0) {
+		i += BLOCK_SIZE;
+	}
+	while (i < size && a_end[-1 - std::ptrdiff_t(i)] == b_end[-1 - std::ptrdiff_t(i)]) {
+		++i;
+	}
+	return i;
+}
+// the smallest edit that turns the old text into the new one
+static Edit get_edit(const char* old_data, std::size_t old_size, const char* new_data, std::size_t new_size) {
+	const std::size_t prefix = get_common_prefix(old_data, new_data, std::min(old_size, new_size));
+	const std::size_t suffix = get_common_suffix(old_data + old_size, new_data + new_size, std::min(old_size, new_size) - prefix);
+	return Edit(prefix, old_size - prefix - suffix, new_size - prefix - suffix);
+}
+
+constexpr std::size_t LINE_INDEX_STEP = 1 << 24;
+constexpr std::size_t TAB_WIDTH = 8;
+// in milliseconds
+constexpr int WATCH_QUIET_TIME = 20;
+constexpr int WATCH_MAX_DELAY = 200;
+
+static volatile sig_atomic_t terminal_resized = 0;
+static void handle_resize(int) {
+	terminal_resized = 1;
+}
+
+// shows one screen at a time, only the visible lines are highlighted and the workspace parses ahead in the background
+class Pager {
+	const Input* input;
+	const char* data;
+	std::size_t size;
+	const Theme& theme;
+	const char* path;
+	const char* file_name;
+	// released instead of destroyed when quitting during a highlight, which would have to finish first
+	std::unique_ptr<Workspace> workspace;
+	Workspace::Document document;
+	// built in steps between key presses so that the first screen does not wait for it
+	LineIndex lines;
+	std::size_t indexed;
+	int tty;
+	termios original_mode;
+	std::size_t rows;
+	std::size_t columns;
+	std::size_t top;
+	std::size_t prefetched;
+	std::string count;
+	std::string pending_keys;
+	// the rows currently on the screen, only rows that differ are redrawn
+	std::vector<std::string> screen;
+	// an inotify instance watching the directory of the file, or -1 where inotify is not available
+	int watch_fd;
+	bool is_indexed() const {
+		return indexed == size;
+	}
+	void index_lines(std::size_t end) {
+		end = std::min(end, size);
+		if (end > indexed) {
+			lines.edit(input, Edit(indexed, 0, end - indexed));
+			indexed = end;
+		}
+	}
+	std::size_t get_next_line(std::size_t pos) const {
+		const char* c = static_cast<const char*>(std::memchr(data + pos, '\n', size - pos));
+		return c ? c - data + 1 : size;
+	}
+	std::size_t get_line_start(std::size_t pos) const {
+		const char* c = static_cast<const char*>(memrchr(data, '\n', pos));
+		return c ? c - data + 1 : 0;
+	}
+	std::size_t get_previous_line(std::size_t pos) const {
+		return pos > 0 ? get_line_start(pos - 1) : 0;
+	}
+	std::size_t get_page_rows() const {
+		return rows > 1 ? rows - 1 : 1;
+	}
+	std::size_t get_last_top() const {
+		std::size_t pos = size > 0 ? get_line_start(size - 1) : 0;
+		for (std::size_t i = 1; i < get_page_rows(); ++i) {
+			pos = get_previous_line(pos);
+		}
+		return pos;
+	}
+	void update_size() {
+		winsize window_size;
+		if (ioctl(tty, TIOCGWINSZ, &window_size) == 0 && window_size.ws_row > 0 && window_size.ws_col > 0) {
+			rows = window_size.ws_row;
+			columns = window_size.ws_col;
+		}
+		screen.clear();
+	}
+	void print_line(std::ostream& out, std::size_t start, std::size_t end, std::vector<Span>::const_iterator& span, std::vector<Span>::const_iterator spans_end) {
+		std::size_t column = 0;
+		int style = -1;
+		for (std::size_t i = start; i < end && column < columns; ++i) {
+			while (span != spans_end && span->end <= i) {
+				++span;
+			}
+			const int new_style = span != spans_end && span->start <= i ? span->style : Style::DEFAULT;
+			if (new_style != style) {
+				apply_style(theme.styles[new_style - Style::DEFAULT], out);
+				style = new_style;
+			}
+			const char c = data[i];
+			if (c == '\t') {
+				const std::size_t spaces = std::min(TAB_WIDTH - column % TAB_WIDTH, columns - column);
+				out << std::string(spaces, ' ');
+				column += spaces;
+			}
+			else if ((c & 0xC0) == 0x80) {
+				out << c;
+			}
+			else if (static_cast<unsigned char>(c) >= 0x20) {
+				out << c;
+				++column;
+			}
+		}
+	}
+	void draw_status(std::size_t end, const char* message) {
+		std::cout << "\e[" << rows << ";1H\e[7m " << file_name;
+		if (top <= indexed) {
+			std::cout << "  line " << lines.get_line(top) + 1;
+			if (is_indexed()) {
+				std::cout << "/" << lines.get_line_count();
+			}
+		}
+		std::cout << "  " << (size > 0 ? end * 100 / size : 100) << "%";
+		if (!count.empty()) {
+			std::cout << "  " << count;
+		}
+		if (message) {
+			std::cout << "  " << message;
+		}
+		std::cout << " \e[K\e[m" << std::flush;
+	}
+	// waits for the spans of a window while still reacting to the quit key, returns false to quit
+	bool wait_for_spans(std::future<std::vector<Span>>& future, std::size_t end) {
+		if (future.wait_for(std::chrono::milliseconds(50)) == std::future_status::ready) {
+			return true;
+		}
+		draw_status(end, "highlighting...");
+		while (future.wait_for(std::chrono::milliseconds(50)) != std::future_status::ready) {
+			pollfd fd = {tty, POLLIN, 0};
+			char buffer[64];
+			ssize_t n;
+			if (poll(&fd, 1, 0) > 0 && (n = read(tty, buffer, sizeof(buffer))) > 0) {
+				const std::string keys(buffer, n);
+				if (keys.find_first_of("qQ\x03") != std::string::npos) {
+					return false;
+				}
+				pending_keys += keys;
+			}
+		}
+		return true;
+	}
+	// returns false to quit
+	bool draw() {
+		const std::size_t page_rows = get_page_rows();
+		std::size_t end = top;
+		for (std::size_t i = 0; i < page_rows && end < size; ++i) {
+			end = get_next_line(end);
+		}
+		std::future<std::vector<Span>> future = workspace->highlight(document, top, end);
+		if (!wait_for_spans(future, end)) {
+			workspace.release();
+			return false;
+		}
+		const std::vector<Span> spans = future.get();
+		// the next page is highlighted while this one is read
+		if (end < size && end > prefetched) {
+			std::size_t next_end = end;
+			for (std::size_t i = 0; i < page_rows && next_end < size; ++i) {
+				next_end = get_next_line(next_end);
+			}
+			workspace->highlight(document, end, next_end);
+			prefetched = next_end;
+		}
+		screen.resize(page_rows);
+		auto span = spans.begin();
+		std::size_t pos = top;
+		for (std::size_t i = 0; i < page_rows; ++i) {
+			std::ostringstream row;
+			set_background_color(theme.background, row);
+			if (pos < size) {
+				const std::size_t next = get_next_line(pos);
+				print_line(row, pos, next, span, spans.end());
+				pos = next;
+			}
+			row << "\e[K";
+			if (row.str() != screen[i]) {
+				screen[i] = row.str();
+				std::cout << "\e[" << i + 1 << ";1H" << screen[i];
+			}
+		}
+		clear_style();
+		draw_status(end, nullptr);
+		return true;
+	}
+	// applies the change of the watched file as an edit so that only the changed part is parsed again
+	void reload() {
+		std::ifstream file(path, std::ios::binary);
+		if (!file) {
+			return;
+		}
+		auto new_input = std::make_unique<FileInput>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		const Edit edit = get_edit(data, size, new_input->data(), new_input->size());
+		if (edit.removed == 0 && edit.inserted == 0) {
+			return;
+		}
+		input = new_input.get();
+		data = new_input->data();
+		size = new_input->size();
+		if (edit.pos + edit.removed <= indexed) {
+			lines.edit(input, edit);
+			indexed = indexed - edit.removed + edit.inserted;
+		}
+		else if (edit.pos < indexed) {
+			lines.edit(input, Edit(edit.pos, indexed - edit.pos, 0));
+			indexed = edit.pos;
+		}
+		workspace->edit(document, std::move(new_input), size, edit.pos);
+		prefetched = std::min(prefetched, edit.pos);
+		top = std::min(get_line_start(std::min(edit.map(top), size)), get_last_top());
+	}
+	// returns true if the file was changed
+	bool read_watch_events() {
+		bool changed = false;
+#ifdef __linux__
+		alignas(inotify_event) char buffer[4096];
+		ssize_t n;
+		while ((n = read(watch_fd, buffer, sizeof(buffer))) > 0) {
+			for (ssize_t i = 0; i < n; i += sizeof(inotify_event) + reinterpret_cast<const inotify_event*>(buffer + i)->len) {
+				const inotify_event* event = reinterpret_cast<const inotify_event*>(buffer + i);
+				if (event->len > 0 && std::strcmp(event->name, file_name) == 0) {
+					changed = true;
+				}
+			}
+		}
+#endif
+		return changed;
+	}
+	// a file is usually truncated before it is written, so the events are collected until the file is quiet for a moment
+	bool wait_for_watch_events() {
+		bool changed = read_watch_events();
+		for (std::size_t i = 0; changed && i < WATCH_MAX_DELAY / WATCH_QUIET_TIME; ++i) {
+			pollfd fd = {watch_fd, POLLIN, 0};
+			if (poll(&fd, 1, WATCH_QUIET_TIME) <= 0) {
+				break;
+			}
+			read_watch_events();
+		}
+		return changed;
+	}
+	void scroll_down(std::size_t n) {
+		const std::size_t last_top = get_last_top();
+		for (std::size_t i = 0; i < n && top < last_top; ++i) {
+			top = get_next_line(top);
+		}
+	}
+	void scroll_up(std::size_t n) {
+		for (std::size_t i = 0; i < n && top > 0; ++i) {
+			top = get_previous_line(top);
+		}
+	}
+	// indexes only up to the line, the first line needs no index at all
+	void go_to_line(std::size_t line) {
+		line = std::max(line, std::size_t(1));
+		while (lines.get_line_count() < line && !is_indexed()) {
+			index_lines(indexed + LINE_INDEX_STEP);
+		}
+		top = std::min(lines.get_line_start(std::min(line, lines.get_line_count()) - 1), get_last_top());
+	}
+	void go_to_percentage(std::size_t percentage) {
+		top = std::min(get_line_start(size * std::min(percentage, std::size_t(100)) / 100), get_last_top());
+	}
+	// returns false when the pager should quit
+	bool handle_keys(const std::string& keys) {
+		for (std::size_t i = 0; i < keys.size(); ++i) {
+			auto matches = [&](const char* sequence) {
+				if (keys.compare(i, std::strlen(sequence), sequence) == 0) {
+					i += std::strlen(sequence) - 1;
+					return true;
+				}
+				return false;
+			};
+			const char c = keys[i];
+			const std::size_t n = count.empty() ? 1 : std::stoul(count);
+			if (c >= '0' && c <= '9') {
+				if (count.size() < 18) {
+					count.push_back(c);
+				}
+				continue;
+			}
+			if (c == 'q' || c == 'Q' || c == '\x03') {
+				return false;
+			}
+			else if (c == 'j' || c == '\n' || c == '\r' || c == 'e' || matches("\e[B") || matches("\eOB")) {
+				scroll_down(n);
+			}
+			else if (c == 'k' || c == 'y' || matches("\e[A") || matches("\eOA")) {
+				scroll_up(n);
+			}
+			else if (c == ' ' || c == 'f' || matches("\e[6~")) {
+				scroll_down(n * get_page_rows());
+			}
+			else if (c == 'b' || matches("\e[5~")) {
+				scroll_up(n * get_page_rows());
+			}
+			else if (c == 'd') {
+				scroll_down(n * get_page_rows() / 2);
+			}
+			else if (c == 'u') {
+				scroll_up(n * get_page_rows() / 2);
+			}
+			else if (c == 'g' || c == '<' || matches("\e[H") || matches("\e[1~")) {
+				go_to_line(n);
+			}
+			else if (c == 'G' || c == '>' || matches("\e[F") || matches("\e[4~")) {
+				if (count.empty()) {
+					top = get_last_top();
+				}
+				else {
+					go_to_line(n);
+				}
+			}
+			else if (c == '%' || c == 'p') {
+				go_to_percentage(count.empty() ? 0 : n);
+			}
+			count.clear();
+		}
+		return true;
+	}
+public:
+	template <class T> Pager(std::unique_ptr<T> input, const Language* language, const Theme& theme, const char* path, int tty, bool watch): input(input.get()), data(input->data()), size(input->size()), theme(theme), path(path), file_name(get_file_name(path)), workspace(std::make_unique<Workspace>(1, 256 << 20)), lines(input.get(), 0), indexed(0), tty(tty), rows(24), columns(80), top(0), prefetched(0), watch_fd(-1) {
+		document = workspace->open(language, std::move(input), size);
+#ifdef __linux__
+		if (watch) {
+			// editors often replace the file instead of writing to it, so the directory is watched
+			const std::string directory = file_name == path ? std::string(".") : std::string(path, file_name - path);
+			watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+			if (watch_fd >= 0) {
+				inotify_add_watch(watch_fd, directory.c_str(), IN_CLOSE_WRITE | IN_MODIFY | IN_MOVED_TO | IN_CREATE);
+			}
+		}
+#endif
+		tcgetattr(tty, &original_mode);
+		termios mode = original_mode;
+		mode.c_lflag &= ~(ICANON | ECHO | ISIG);
+		mode.c_cc[VMIN] = 1;
+		mode.c_cc[VTIME] = 0;
+		tcsetattr(tty, TCSAFLUSH, &mode);
+		struct sigaction action = {};
+		action.sa_handler = handle_resize;
+		sigaction(SIGWINCH, &action, nullptr);
+		std::cout << "\e[?1049h\e[?25l";
+		update_size();
+	}
+	Pager(const Pager&) = delete;
+	Pager& operator =(const Pager&) = delete;
+	~Pager() {
+		std::cout << "\e[m\e[?25h\e[?1049l" << std::flush;
+		tcsetattr(tty, TCSAFLUSH, &original_mode);
+		if (watch_fd >= 0) {
+			close(watch_fd);
+		}
+	}
+	void run() {
+		if (!draw()) {
+			return;
+		}
+		while (true) {
+			if (!pending_keys.empty()) {
+				const std::string keys = std::move(pending_keys);
+				pending_keys.clear();
+				if (!handle_keys(keys) || !draw()) {
+					return;
+				}
+				continue;
+			}
+			pollfd fds[] = {{tty, POLLIN, 0}, {watch_fd, POLLIN, 0}};
+			const int ready = poll(fds, watch_fd >= 0 ? 2 : 1, is_indexed() ? -1 : 0);
+			if (terminal_resized) {
+				terminal_resized = 0;
+				update_size();
+				top = std::min(top, get_last_top());
+				if (!draw()) {
+					return;
+				}
+			}
+			if (ready == 0) {
+				const bool was_indexed = top <= indexed;
+				index_lines(indexed + LINE_INDEX_STEP);
+				if ((!was_indexed || is_indexed()) && !draw()) {
+					return;
+				}
+				continue;
+			}
+			if (ready < 0) {
+				continue;
+			}
+			if (watch_fd >= 0 && (fds[1].revents & POLLIN)) {
+				if (wait_for_watch_events()) {
+					reload();
+					if (!draw()) {
+						return;
+					}
+				}
+			}
+			if (!(fds[0].revents & POLLIN)) {
+				continue;
+			}
+			char buffer[64];
+			const ssize_t n = read(tty, buffer, sizeof(buffer));
+			if (n <= 0 || !handle_keys(std::string(buffer, n)) || !draw()) {
+				return;
+			}
+		}
+	}
+};
+#endif
+
+#ifdef POSIX_TERMINAL
+// prints the spans as they are written and releases the input behind them
+class TerminalOutput final: public StreamOutput {
+	StreamInput& input;
+	const Theme& theme;
+	std::size_t printed;
+	void print_input(std::size_t start, std::size_t end) {
+		input.for_each_chunk(start, end, [](const char* data, std::size_t size) {
+			std::cout.write(data, size);
+		});
+	}
+public:
+	TerminalOutput(StreamInput& input, const Theme& theme): input(input), theme(theme), printed(0) {}
+	void write(const std::vector<Span>& spans, std::size_t pos) override {
+		for (const Span& span: spans) {
+			if (span.start > printed) {
+				apply_style(theme.styles[0]);
+				print_input(printed, span.start);
+			}
+			apply_style(theme.styles[span.style - Style::DEFAULT]);
+			print_input(span.start, span.end);
+			printed = span.end;
+		}
+		if (pos > printed) {
+			apply_style(theme.styles[0]);
+			print_input(printed, pos);
+			printed = pos;
+		}
+		std::cout << std::flush;
+		input.release(pos);
+	}
+};
+
+static void highlight_stream(int fd, const Language* language, const Theme& theme) {
+	StreamInput input(fd);
+	TerminalOutput output(input, theme);
+	set_background_color(theme.background);
+	std::cout << '\n';
+	prism::highlight_stream(language, &input, output);
+	clear_style();
+	std::cout << '\n';
+}
+#endif
+
+#ifdef POSIX_TERMINAL
+constexpr int FOLLOW_TIMEOUT = 1000;
+
+static void handle_interrupt(int) {
+	write(STDOUT_FILENO, "\e[m\n", 4);
+	_exit(0);
+}
+#endif
+
+// prints the file and then what is appended to it like tail -f, only the parse state at the old end of the file is repeated
+// complete lines are printed right away, an incomplete last line once the file has not grown for a while
+static int follow(const char* path, const Language* language, const Theme& theme) {
+#ifdef POSIX_TERMINAL
+	const int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		std::cerr << "cannot open " << path << "\n";
+		return 1;
+	}
+	// without inotify the file is only checked after each timeout
+#ifdef __linux__
+	const int watch_fd = inotify_init1(IN_CLOEXEC);
+	if (watch_fd >= 0) {
+		inotify_add_watch(watch_fd, path, IN_MODIFY);
+	}
+#else
+	const int watch_fd = -1;
+#endif
+	signal(SIGINT, handle_interrupt);
+	FileInput input;
+	Cache cache;
+	// the size of the input when it was last highlighted
+	std::size_t parsed_size = 0;
+	std::size_t printed = 0;
+	bool timed_out = false;
+	std::vector<char> buffer(1 << 16);
+	set_background_color(theme.background);
+	while (true) {
+		ssize_t n;
+		while ((n = read(fd, buffer.data(), buffer.size())) > 0) {
+			input.append(buffer.data(), n);
+		}
+		struct stat status;
+		if (fstat(fd, &status) == 0 && static_cast<std::size_t>(status.st_size) < input.size()) {
+			// the file was truncated, start over
+			lseek(fd, 0, SEEK_SET);
+			input.clear();
+			cache = Cache();
+			parsed_size = 0;
+			printed = 0;
+			continue;
+		}
+		const char* last_newline = static_cast<const char*>(memrchr(input.data() + printed, '\n', input.size() - printed));
+		const std::size_t end = timed_out ? input.size() : last_newline ? last_newline - input.data() + 1 : printed;
+		if (end > printed) {
+			std::vector<Span> spans;
+			for (const Span& span: prism::highlight_appended(language, &input, cache, parsed_size, printed, end)) {
+				if (const Range range = span & Range(printed, end)) {
+					spans.emplace_back(range.start, range.end, span.style);
+				}
+			}
+			parsed_size = input.size();
+			print(input, spans, theme, printed, end);
+			std::cout << std::flush;
+			printed = end;
+		}
+		pollfd watch = {watch_fd, POLLIN, 0};
+		const int ready = poll(&watch, watch_fd >= 0 ? 1 : 0, FOLLOW_TIMEOUT);
+		if (ready > 0) {
+			read(watch_fd, buffer.data(), buffer.size());
+		}
+		timed_out = ready == 0;
+	}
+#else
+	std::cerr << "--follow is not supported on this platform\n";
+	return 1;
+#endif
+}
+
+static int page(const char* path, const Language* language, const Theme& theme, bool watch) {
+#ifdef POSIX_TERMINAL
+#ifndef __linux__
+	if (watch) {
+		std::cerr << "--watch is not supported on this platform\n";
+		return 1;
+	}
+#endif
+	const int tty = open("/dev/tty", O_RDWR);
+	if (tty < 0 || !isatty(STDOUT_FILENO)) {
+		std::cerr << "the pager needs a terminal\n";
+		return 1;
+	}
+	if (watch) {
+		// a mapped file could change under the parser, so the watched file is read instead
+		std::ifstream file(path, std::ios::binary);
+		Pager pager(std::make_unique<FileInput>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()), language, theme, path, tty, true);
+		pager.run();
+		return 0;
+	}
+	Pager pager(std::make_unique<MappedInput>(path), language, theme, path, tty, false);
+	pager.run();
+	return 0;
+#else
+	std::cerr << "the pager is not supported on this platform\n";
+	return 1;
+#endif
+}
+
+// a bare extension such as json is looked up as a file name with that extension
+static const Language* find_language(const char* name) {
+	if (const Language* language = prism::get_language(get_file_name(name))) {
+		return language;
+	}
+	return prism::get_language(("file." + std::string(name)).c_str());
+}
+
 int main(int argc, const char** argv) {
-	if (argc <= 1) {
-		std::cerr << "Usage: " << argv[0] << " FILE [THEME]\n";
+	bool pager = false;
+	bool watch = false;
+	bool follow_file = false;
+	const char* language_name = nullptr;
+	std::vector<const char*> arguments;
+	for (int i = 1; i < argc; ++i) {
+		if (std::strcmp(argv[i], "--pager") == 0) {
+			pager = true;
+		}
+		else if (std::strcmp(argv[i], "--watch") == 0) {
+			watch = true;
+		}
+		else if (std::strcmp(argv[i], "--follow") == 0) {
+			follow_file = true;
+		}
+		else if (std::strcmp(argv[i], "--language") == 0 && i + 1 < argc) {
+			language_name = argv[++i];
+		}
+		else {
+			arguments.push_back(argv[i]);
+		}
+	}
+	if (arguments.empty()) {
+		std::cerr << "Usage: " << argv[0] << " [--pager | --watch | --follow] [--language NAME] FILE [THEME]\n";
+		std::cerr << "FILE can be - to read from stdin, pipes are highlighted as they are read\n";
 		return 1;
 	}
-	const char* path = argv[1];
-	const Language* language = prism::get_language(get_file_name(path));
+	const char* path = arguments[0];
+	const Language* language = find_language(language_name ? language_name : path);
 	if (language == nullptr) {
 		std::cerr << "prism does currently not support this language\n";
 		return 1;
 	}
-	const Theme& theme = prism::get_theme(argc > 2 ? argv[2] : "one-dark");
+	const Theme& theme = prism::get_theme(arguments.size() > 1 ? arguments[1] : "one-dark");
+	if (follow_file) {
+		return follow(path, language, theme);
+	}
+#ifdef POSIX_TERMINAL
+	struct stat status;
+	if (std::strcmp(path, "-") == 0) {
+		highlight_stream(STDIN_FILENO, language, theme);
+		return 0;
+	}
+	if (stat(path, &status) == 0 && S_ISFIFO(status.st_mode)) {
+		const int fd = open(path, O_RDONLY);
+		highlight_stream(fd, language, theme);
+		close(fd);
+		return 0;
+	}
+#else
+	if (std::strcmp(path, "-") == 0) {
+		std::cerr << "reading from stdin is not supported on this platform\n";
+		return 1;
+	}
+#endif
+	if (pager || watch) {
+		return page(path, language, theme, watch);
+	}
 	highlight(path, language, theme);
 }
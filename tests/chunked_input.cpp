@@ -0,0 +1,77 @@
+#include <prism.hpp>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <random>
+
+// serves a string in chunks of a fixed size
+class ChunkedInput final: public Input {
+	const std::string& data;
+	std::size_t chunk_size;
+	Chunk get_chunk_at(std::size_t offset) const {
+		if (offset >= data.size()) {
+			return {nullptr, "", 0};
+		}
+		return {data.data() + offset, data.data() + offset, std::min(chunk_size, data.size() - offset)};
+	}
+public:
+	ChunkedInput(const std::string& data, std::size_t chunk_size): data(data), chunk_size(chunk_size) {}
+	std::pair<Chunk, std::size_t> get_chunk(std::size_t pos) const override {
+		const std::size_t offset = pos / chunk_size * chunk_size;
+		return {get_chunk_at(offset), offset};
+	}
+	Chunk get_next_chunk(const void* chunk) const override {
+		if (chunk == nullptr) {
+			return {nullptr, "", 0};
+		}
+		return get_chunk_at(static_cast<const char*>(chunk) - data.data() + chunk_size);
+	}
+};
+
+// highlights with a bounded lookahead that ends on a chunk boundary must not leave checkpoints
+// that change later highlights, so the results have to match a fresh cache
+static std::size_t check(const Language* language, const std::string& data, std::size_t chunk_size) {
+	const ChunkedInput input(data, chunk_size);
+	std::mt19937 random(chunk_size);
+	std::size_t mismatches = 0;
+	for (int i = 0; i < 50; ++i) {
+		Cache cache;
+		for (int j = 0; j < 10; ++j) {
+			const std::size_t start = random() % data.size();
+			const std::size_t end = std::min(data.size(), start + random() % 1000);
+			const std::size_t lookahead_end = (end / chunk_size + 1 + random() % 2) * chunk_size;
+			prism::highlight(language, &input, cache, start, end, lookahead_end - end);
+		}
+		const std::size_t start = random() % data.size();
+		const std::size_t end = std::min(data.size(), start + random() % 2000);
+		Cache fresh_cache;
+		if (prism::highlight(language, &input, cache, start, end) != prism::highlight(language, &input, fresh_cache, start, end)) {
+			++mismatches;
+		}
+	}
+	return mismatches;
+}
+
+int main(int argc, const char** argv) {
+	std::size_t mismatches = 0;
+	for (int i = 1; i < argc; ++i) {
+		std::ifstream file(argv[i], std::ios::binary);
+		std::ostringstream stream;
+		stream << file.rdbuf();
+		const std::string data = stream.str();
+		const std::string path = argv[i];
+		const Language* language = prism::get_language(path.substr(path.find_last_of("/\\") + 1).c_str());
+		if (language == nullptr || data.empty()) {
+			std::cerr << "cannot test " << path << "\n";
+			return 1;
+		}
+		for (std::size_t chunk_size: {16, 64, 4096}) {
+			const std::size_t file_mismatches = check(language, data, chunk_size);
+			if (file_mismatches > 0) {
+				std::cerr << path << ": " << file_mismatches << " mismatches with chunks of " << chunk_size << " bytes\n";
+			}
+			mismatches += file_mismatches;
+		}
+	}
+	return mismatches > 0 ? 1 : 0;
+}
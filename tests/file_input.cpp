@@ -0,0 +1,111 @@
+#include <file_input.hpp>
+#include <cstdlib>
+#include <string>
+#include <iostream>
+#include <thread>
+#include <unistd.h>
+
+constexpr std::size_t BLOCK_SIZE = 256;
+
+// forwards to another input and records the positions it is asked for chunks at
+class RecordingInput final: public Input {
+	const Input& input;
+public:
+	mutable std::vector<std::size_t> positions;
+	RecordingInput(const Input& input): input(input) {}
+	std::pair<Chunk, std::size_t> get_chunk(std::size_t pos) const override {
+		positions.push_back(pos);
+		return input.get_chunk(pos);
+	}
+	Chunk get_next_chunk(const void* chunk) const override {
+		return input.get_next_chunk(chunk);
+	}
+	void prefetch(std::size_t start, std::size_t end) const override {
+		input.prefetch(start, end);
+	}
+};
+
+// each thread reads every other block, a chunk has to stay intact while the other thread evicts blocks from the small cache
+static std::size_t read_blocks(const ChunkedFileInput& input, const std::string& data, std::size_t first_block) {
+	std::size_t mismatches = 0;
+	for (std::size_t block = first_block; block * BLOCK_SIZE < data.size(); block += 2) {
+		const auto chunk = input.get_chunk(block * BLOCK_SIZE);
+		std::this_thread::yield();
+		if (chunk.second != block * BLOCK_SIZE || data.compare(chunk.second, chunk.first.size, chunk.first.data, chunk.first.size) != 0) {
+			++mismatches;
+		}
+		const Input::Chunk next = input.get_next_chunk(chunk.first.chunk);
+		std::this_thread::yield();
+		const std::size_t next_offset = (block + 1) * BLOCK_SIZE;
+		if (next_offset < data.size() && data.compare(next_offset, next.size, next.data, next.size) != 0) {
+			++mismatches;
+		}
+	}
+	return mismatches;
+}
+
+// a highlight that resumes from a checkpoint must not fetch the start of the file, the results have to match a string input
+static std::size_t highlight_windows(const Language* language, const ChunkedFileInput& input, const std::string& data, std::size_t first_window) {
+	const StringInput string_input(data.data(), data.size());
+	const RecordingInput recording_input(input);
+	const std::size_t window_size = data.size() / 8;
+	Cache cache;
+	prism::highlight(language, &recording_input, cache, 0, data.size());
+	std::size_t mismatches = 0;
+	for (std::size_t window = first_window + 2; window < 8; window += 2) {
+		recording_input.positions.clear();
+		const std::size_t start = window * window_size;
+		Cache fresh_cache;
+		if (prism::highlight(language, &recording_input, cache, start, start + window_size) != prism::highlight(language, &string_input, fresh_cache, start, start + window_size)) {
+			++mismatches;
+		}
+		for (std::size_t pos: recording_input.positions) {
+			if (pos < BLOCK_SIZE) {
+				++mismatches;
+			}
+		}
+	}
+	return mismatches;
+}
+
+int main() {
+	std::string data;
+	for (int i = 0; data.size() < 64 * BLOCK_SIZE; ++i) {
+		data += "var x" + std::to_string(i) + " = \"line " + std::to_string(i) + "\"; // comment\n";
+	}
+	char path[] = "/tmp/prism-test-XXXXXX";
+	const int fd = mkstemp(path);
+	if (fd < 0 || write(fd, data.data(), data.size()) != static_cast<ssize_t>(data.size())) {
+		std::cerr << "cannot write " << path << "\n";
+		return 1;
+	}
+	close(fd);
+	std::size_t mismatches[4] = {};
+	{
+		const ChunkedFileInput input(path, 2 * BLOCK_SIZE, BLOCK_SIZE);
+		std::thread thread([&]() {
+			mismatches[1] = read_blocks(input, data, 1);
+		});
+		mismatches[0] = read_blocks(input, data, 0);
+		thread.join();
+	}
+	{
+		const Language* language = prism::get_language("test.js");
+		const ChunkedFileInput input(path, 4 * BLOCK_SIZE, BLOCK_SIZE);
+		std::thread thread([&]() {
+			mismatches[3] = highlight_windows(language, input, data, 1);
+		});
+		mismatches[2] = highlight_windows(language, input, data, 0);
+		thread.join();
+	}
+	unlink(path);
+	const char* names[] = {"reading even blocks", "reading odd blocks", "highlighting even windows", "highlighting odd windows"};
+	std::size_t total = 0;
+	for (std::size_t i = 0; i < 4; ++i) {
+		if (mismatches[i] > 0) {
+			std::cerr << names[i] << ": " << mismatches[i] << " mismatches\n";
+		}
+		total += mismatches[i];
+	}
+	return total > 0 ? 1 : 0;
+}
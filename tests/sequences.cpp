@@ -0,0 +1,34 @@
+#include <prism.hpp>
+#include <iostream>
+#include <string>
+
+// whether the range [start, end) of the text is a single span of the style
+static bool has_span(const std::vector<Span>& spans, std::size_t start, std::size_t end, int style) {
+	for (const Span& span: spans) {
+		if (span.start == start && span.end == end && span.style == style) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool check(const char* file_name, const std::string& text, std::size_t start, std::size_t end, int style, bool expected) {
+	const StringInput input(text.data(), text.size());
+	Cache cache;
+	const std::vector<Span> spans = prism::highlight(prism::get_language(file_name), &input, cache, 0, text.size());
+	if (has_span(spans, start, end, style) != expected) {
+		std::cerr << file_name << ": " << text << ": [" << start << ", " << end << ") is " << (expected ? "not " : "") << "a span of style " << style << "\n";
+		return false;
+	}
+	return true;
+}
+
+// sequences that start with several chars are merged into strings, the elements after them must be kept
+int main() {
+	bool success = true;
+	success &= check("test.xml", "<a b=\"&#x1F600;\"/>", 6, 15, Style::ESCAPE, true);
+	success &= check("test.xml", "<a b=\"&#x;\"/>", 6, 10, Style::ESCAPE, false);
+	success &= check("test.xml", "<a b=\"&#123;\"/>", 6, 12, Style::ESCAPE, true);
+	success &= check("test.xml", "<a b=\"&amp;\"/>", 6, 11, Style::ESCAPE, true);
+	return success ? 0 : 1;
+}
@@ -0,0 +1,197 @@
+#include "workspace.hpp"
+
+constexpr std::size_t PREPARSE_STEP = 1 << 16;
+
+Workspace::DocumentState::DocumentState(const Language* language, std::unique_ptr<Input> input, std::size_t size): language(language), input(std::move(input)), size(size), parsed(0), memory_usage(cache.get_memory_usage()), measured_end(0), measured_memory_usage(memory_usage), last_viewed(0), busy(false), waiting(0), edited_size(0), edit_pos(0) {}
+
+Workspace::DocumentState* Workspace::get_document(Document document) {
+	auto iter = documents.find(document);
+	if (iter != documents.end()) {
+		return iter->second.get();
+	}
+	return nullptr;
+}
+Workspace::DocumentState* Workspace::wait_for_document(std::unique_lock<std::mutex>& lock, Document document) {
+	DocumentState* state = get_document(document);
+	if (state == nullptr) {
+		return nullptr;
+	}
+	++state->waiting;
+	condition.wait(lock, [state]() {
+		return !state->busy;
+	});
+	--state->waiting;
+	return state;
+}
+Workspace::DocumentState* Workspace::find_preparse_document() {
+	if (memory_limit != 0 && memory_usage >= memory_limit) {
+		return nullptr;
+	}
+	DocumentState* result = nullptr;
+	for (auto& document: documents) {
+		DocumentState* state = document.second.get();
+		if (state->busy || state->waiting > 0 || state->parsed >= state->size) {
+			continue;
+		}
+		if (result == nullptr || state->last_viewed > result->last_viewed) {
+			result = state;
+		}
+	}
+	return result;
+}
+// walking the cache is linear in its size, so it is only measured when its valid end doubled or when asked to
+std::size_t Workspace::estimate_memory_usage(DocumentState* document, bool measure) {
+	const std::size_t end = document->cache.get_valid_end();
+	if (measure || end >= 2 * document->measured_end) {
+		document->measured_end = end;
+		document->measured_memory_usage = document->cache.get_memory_usage();
+		return document->measured_memory_usage;
+	}
+	return static_cast<double>(document->measured_memory_usage) * end / document->measured_end;
+}
+void Workspace::update_memory_usage(DocumentState* document, std::size_t new_memory_usage) {
+	memory_usage = memory_usage - document->memory_usage + new_memory_usage;
+	document->memory_usage = new_memory_usage;
+}
+void Workspace::apply_edit(DocumentState* document) {
+	if (document->edited_input == nullptr) {
+		return;
+	}
+	document->input = std::move(document->edited_input);
+	document->size = document->edited_size;
+	document->cache.invalidate(document->edit_pos);
+	document->parsed = std::min(document->parsed, document->edit_pos);
+	update_memory_usage(document, estimate_memory_usage(document, false));
+}
+void Workspace::enforce_memory_limit(const DocumentState* document) {
+	const std::size_t empty_memory_usage = Cache().get_memory_usage();
+	while (memory_limit != 0 && memory_usage > memory_limit) {
+		DocumentState* victim = nullptr;
+		for (auto& other_document: documents) {
+			DocumentState* state = other_document.second.get();
+			if (state == document || state->busy || state->memory_usage <= empty_memory_usage || state->last_viewed >= document->last_viewed) {
+				continue;
+			}
+			if (victim == nullptr || state->last_viewed < victim->last_viewed) {
+				victim = state;
+			}
+		}
+		if (victim == nullptr) {
+			return;
+		}
+		victim->cache = Cache(victim->cache.get_max_depth());
+		victim->parsed = 0;
+		update_memory_usage(victim, estimate_memory_usage(victim, true));
+	}
+}
+void Workspace::run_worker() {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (!stopping) {
+		auto iter = std::find_if(requests.begin(), requests.end(), [this](const Request& request) {
+			const DocumentState* state = get_document(request.document);
+			return state == nullptr || (!state->busy && state->waiting == 0);
+		});
+		if (iter != requests.end()) {
+			Request request = std::move(*iter);
+			requests.erase(iter);
+			DocumentState* document = get_document(request.document);
+			if (document == nullptr) {
+				request.promise.set_value({});
+				continue;
+			}
+			document->busy = true;
+			lock.unlock();
+			request.promise.set_value(prism::highlight(document->language, document->input.get(), document->cache, request.window_start, request.window_end));
+			const std::size_t new_memory_usage = estimate_memory_usage(document, false);
+			lock.lock();
+			update_memory_usage(document, new_memory_usage);
+			enforce_memory_limit(document);
+			document->busy = false;
+			apply_edit(document);
+			condition.notify_all();
+			continue;
+		}
+		if (DocumentState* document = find_preparse_document()) {
+			const std::size_t pos = std::min(document->parsed + PREPARSE_STEP, document->size);
+			document->busy = true;
+			lock.unlock();
+			prism::highlight(document->language, document->input.get(), document->cache, pos, pos);
+			const std::size_t new_memory_usage = estimate_memory_usage(document, pos == document->size);
+			lock.lock();
+			document->parsed = pos;
+			update_memory_usage(document, new_memory_usage);
+			enforce_memory_limit(document);
+			document->busy = false;
+			apply_edit(document);
+			condition.notify_all();
+			continue;
+		}
+		condition.wait(lock);
+	}
+}
+
+Workspace::Workspace(std::size_t threads, std::size_t memory_limit): memory_limit(memory_limit), next_document(0), clock(0), memory_usage(0), stopping(false) {
+	for (std::size_t i = 0; i < std::max(threads, std::size_t(1)); ++i) {
+		workers.emplace_back(&Workspace::run_worker, this);
+	}
+}
+Workspace::~Workspace() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	condition.notify_all();
+	for (std::thread& worker: workers) {
+		worker.join();
+	}
+}
+Workspace::Document Workspace::open(const Language* language, std::unique_ptr<Input> input, std::size_t size) {
+	std::lock_guard<std::mutex> lock(mutex);
+	const Document document = next_document++;
+	auto& state = documents[document] = std::make_unique<DocumentState>(language, std::move(input), size);
+	memory_usage += state->memory_usage;
+	condition.notify_all();
+	return document;
+}
+void Workspace::edit(Document document, std::unique_ptr<Input> input, std::size_t size, std::size_t pos) {
+	std::lock_guard<std::mutex> lock(mutex);
+	DocumentState* state = get_document(document);
+	if (state == nullptr) {
+		return;
+	}
+	state->edit_pos = state->edited_input ? std::min(state->edit_pos, pos) : pos;
+	state->edited_input = std::move(input);
+	state->edited_size = size;
+	if (!state->busy) {
+		apply_edit(state);
+	}
+	condition.notify_all();
+}
+void Workspace::close(Document document) {
+	std::unique_lock<std::mutex> lock(mutex);
+	DocumentState* state = wait_for_document(lock, document);
+	if (state == nullptr) {
+		return;
+	}
+	memory_usage -= state->memory_usage;
+	documents.erase(document);
+	condition.notify_all();
+}
+std::future<std::vector<Span>> Workspace::highlight(Document document, std::size_t window_start, std::size_t window_end) {
+	std::lock_guard<std::mutex> lock(mutex);
+	Request request = {document, window_start, window_end, {}};
+	auto future = request.promise.get_future();
+	if (DocumentState* state = get_document(document)) {
+		state->last_viewed = ++clock;
+		requests.push_back(std::move(request));
+		condition.notify_all();
+	}
+	else {
+		request.promise.set_value({});
+	}
+	return future;
+}
+std::size_t Workspace::get_memory_usage() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return memory_usage;
+}
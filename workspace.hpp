@@ -0,0 +1,71 @@
+#pragma once
+
+#include "prism.hpp"
+#include <cstdint>
+#include <memory>
+#include <map>
+#include <deque>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+class Workspace {
+public:
+	using Document = std::size_t;
+private:
+	struct DocumentState {
+		const Language* language;
+		std::unique_ptr<Input> input;
+		std::size_t size;
+		Cache cache;
+		std::size_t parsed;
+		std::size_t memory_usage;
+		// the cache was last measured when it was valid up to measured_end, in between its memory usage is extrapolated
+		std::size_t measured_end;
+		std::size_t measured_memory_usage;
+		std::uint64_t last_viewed;
+		bool busy;
+		std::size_t waiting;
+		// an edit of a busy document, applied when it is no longer busy, later edits replace the input and keep the first pos
+		std::unique_ptr<Input> edited_input;
+		std::size_t edited_size;
+		std::size_t edit_pos;
+		DocumentState(const Language* language, std::unique_ptr<Input> input, std::size_t size);
+	};
+	struct Request {
+		Document document;
+		std::size_t window_start;
+		std::size_t window_end;
+		std::promise<std::vector<Span>> promise;
+	};
+	std::size_t memory_limit;
+	std::mutex mutex;
+	std::condition_variable condition;
+	std::map<Document, std::unique_ptr<DocumentState>> documents;
+	std::deque<Request> requests;
+	Document next_document;
+	std::uint64_t clock;
+	std::size_t memory_usage;
+	bool stopping;
+	std::vector<std::thread> workers;
+	DocumentState* get_document(Document document);
+	DocumentState* wait_for_document(std::unique_lock<std::mutex>& lock, Document document);
+	DocumentState* find_preparse_document();
+	static std::size_t estimate_memory_usage(DocumentState* document, bool measure);
+	void update_memory_usage(DocumentState* document, std::size_t new_memory_usage);
+	void apply_edit(DocumentState* document);
+	void enforce_memory_limit(const DocumentState* document);
+	void run_worker();
+public:
+	Workspace(std::size_t threads = std::thread::hardware_concurrency(), std::size_t memory_limit = 0);
+	Workspace(const Workspace&) = delete;
+	Workspace& operator =(const Workspace&) = delete;
+	~Workspace();
+	Document open(const Language* language, std::unique_ptr<Input> input, std::size_t size);
+	// does not wait for a running highlight of the document, the edit is applied before the next one
+	void edit(Document document, std::unique_ptr<Input> input, std::size_t size, std::size_t pos);
+	void close(Document document);
+	std::future<std::vector<Span>> highlight(Document document, std::size_t window_start, std::size_t window_end);
+	std::size_t get_memory_usage();
+};